@@ -1,1045 +1,7369 @@
 #include <stdio.h>
+#include <stdarg.h>
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/sysinfo.h>
+#include <signal.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 #include "util.h"
+#include "miniclisp.h"
 
 #define DEBUG 0
 
-#define MAXTOKENLEN 32
-
 const char *TRUE = "#t";
 const char *FALSE = "#f";
 
 struct env;
+struct dictentry;
+struct interp;
+
+/*
+ * Interned symbol. There is exactly one symbol struct per name, so two
+ * symbols are equal iff their pointers are equal.
+ */
+typedef struct symbol {
+	char *name;
+	size_t len;
+	unsigned int hash;
+	struct symbol *next;
+	struct expr *expr;	/* The shared EXPRSYM or NULL. */
+} symbol;
+
+/*
+ * A free variable of a lambda: a variable of an enclosing lambda which
+ * the closure captures. It is taken from the frame (depth 0) or the
+ * closure record (depth 1) of the lambda which creates the closure.
+ */
+typedef struct freevar {
+	symbol *sym;
+	int depth;
+	int slot;
+} freevar;
+
+/*
+ * Frame layout of a lambda, computed once by the analysis. The
+ * first argc slots hold the parameters, the remaining ones the variables
+ * defined in the lambda body. The analyzed body and the bytecode are
+ * kept here as well. A lambda lives as long as its body: closures and
+ * lambda nodes trace the body, and a major collection which does not
+ * reach it frees the lambda, see gc_sweep_lambdas.
+ */
+typedef struct lambdainfo {
+	int argc;
+	int nslots;
+	symbol **slots;
+	int nfree;
+	freevar *free;
+	struct node *body;
+	struct code *code;
+	symbol *name;		/* The variable it was defined as or NULL. */
+} lambdainfo;
+
+/*
+ * The result of an evaluation. A value is either an immediate or a
+ * pointer to a heap object, distinguished by the low bits:
+ *   ...1    a fixnum; the integer is stored in the upper bits.
+ *   ...010  one of the constants VAL_FALSE, VAL_TRUE and VAL_EMPTY.
+ *   ...100  a pointer to a pair, plus PAIR_TAG.
+ *   ...000  a pointer to an expr: an EXPRINT for integers which don't
+ *           fit into a fixnum, an EXPRBIG for those which don't fit
+ *           into a long long, an EXPRVECTOR, a quoted EXPRSYM, an
+ *           EXPRLAMBDA closure, an EXPRPROC, an EXPRNATIVE or an
+ *           EXPRFUTURE.
+ * The reader returns values as well: a list is a chain of pairs which
+ * ends in VAL_EMPTY. NULL is not a value; it marks unbound variables.
+ */
+typedef struct valuetag *value;
+
+#define VAL_FALSE MINICLISP_FALSE
+#define VAL_TRUE MINICLISP_TRUE
+#define VAL_EMPTY MINICLISP_EMPTY
 
-enum exprtype { EXPRPROC, EXPRSYM, EXPRINT, EXPRLAMBDA, EXPRLIST, EXPREMPTY };
+#define PAIR_TAG 0x4
+
+/*
+ * A pair of two values. Pairs have their own pool, so a pair takes just
+ * two words, and lists share their tails instead of being copied.
+ */
+typedef struct pair {
+	value car;
+	value cdr;
+} pair;
+
+#define FIXNUM_MAX (INTPTR_MAX >> 1)
+#define FIXNUM_MIN (INTPTR_MIN >> 1)
+
+enum exprtype { EXPRPROC, EXPRSYM, EXPRINT, EXPRLAMBDA, EXPRBIG, EXPRVECTOR,
+	EXPRFUTURE, EXPRNATIVE
+};
 typedef struct expr {
 	union {
 		long long int intvalue;
-		char symvalue[MAXTOKENLEN];
-		struct expr *listptr;
+		symbol *symvalue;
 		struct {
-			struct expr *lambdavars;
-			struct expr *lambdaexpr;
+			value lambdavars;
+			value lambdaexpr;
 			struct env *lambdaenv;
+			lambdainfo *lambdainfo;
+		};
+		 value(*proc) (struct interp * ip, int argc, value * argv);
+		struct {
+			/* A bignum: see BIGNUMS. */
+			uint32_t *digits;
+			size_t ndigits;
+			bool negative;
+		};
+		struct {
+			/* A vector: see VECTORS. */
+			int64_t *elements;
+			size_t length;
+		};
+		struct {
+			/* A future: see FUTURES. */
+			struct node *task;
+			struct env *taskenv;
+			value result;
+			int state;
+		};
+		struct {
+			/* A procedure of the embedding program. */
+			miniclisp_native native;
+			void *data;
+			int arity;
+			symbol *nativename;
 		};
-		struct expr *(*proc) (struct expr *);
 	};
 	enum exprtype type;
-	struct expr *next;
-	bool in_use;
 } expr;
 
+static inline bool is_fixnum(value v)
+{
+	return ((uintptr_t) v & 1) != 0;
+}
+
+static inline bool is_pair(value v)
+{
+	return ((uintptr_t) v & 7) == PAIR_TAG;
+}
+
+static inline pair *value_pair(value v)
+{
+	return (pair *) ((uintptr_t) v - PAIR_TAG);
+}
+
+static inline intptr_t fixnum_value(value v)
+{
+	return (intptr_t) v >> 1;
+}
+
+static inline value make_fixnum(intptr_t i)
+{
+	return (value) (((uintptr_t) i << 1) | 1);
+}
+
+static inline value make_bool(bool b)
+{
+	return b ? VAL_TRUE : VAL_FALSE;
+}
+
+/* Returns the expr of a heap value or NULL for an immediate or a pair. */
+static inline expr *value_expr(value v)
+{
+	return ((uintptr_t) v & 7) != 0 ? NULL : (expr *) v;
+}
+
+static inline bool is_int(value v)
+{
+	return is_fixnum(v) || (v != NULL && value_expr(v) != NULL
+				&& value_expr(v)->type == EXPRINT);
+}
+
+static inline long long int get_int(value v)
+{
+	return is_fixnum(v) ? fixnum_value(v) : value_expr(v)->intvalue;
+}
+
+/* An integer of any size. */
+static inline bool is_number(value v)
+{
+	return is_int(v) || (v != NULL && value_expr(v) != NULL
+			     && value_expr(v)->type == EXPRBIG);
+}
+
 typedef struct dictentry {
-	expr *sym;
-	expr *value;
-	struct dictentry *next;
+	symbol *sym;
+	value value;
 } dictentry;
 
+/* Frames with more bindings than this are turned into hash tables. */
+#define ENV_SMALL_MAX 8
+
+/*
+ * An environment frame. Small frames (e.g. lambda parameters) keep
+ * their bindings in a dense array which is searched linearly. Once a
+ * frame grows beyond ENV_SMALL_MAX bindings, `entries' becomes an open
+ * addressing hash table (linear probing, keyed by the symbol hash)
+ * whose size is a power of two. The dictentry structs themselves are
+ * never moved, so pointers to them stay valid.
+ * A dictentry whose value is NULL is an unbound slot: it has been
+ * reserved by the analysis but not yet defined.
+ */
 typedef struct env {
-	dictentry *list;
+	dictentry **entries;
+	size_t count;
+	size_t capacity;
+	bool hashed;
 	struct env *outer;
-	bool in_use;
 } env;
 
-static env *global_env;
-static env *current_env;
+/*
+ * An inline cache of a variable reference which the analysis could not
+ * resolve: a frame slot which is not bound yet, so the binding is
+ * searched in the enclosing frames. The cache remembers the binding
+ * found from the frame `outer'. It is valid while the global_version
+ * of the interpreter is unchanged: add_to_env increments it whenever a
+ * variable becomes bound, and every collection does as well, because it
+ * moves frames and reuses their memory.
+ */
+typedef struct lookupcache {
+	size_t version;
+	env *outer;
+	dictentry *cell;
+} lookupcache;
+
+/*
+ * The node types of an analyzed expression. The analysis turns every
+ * form once into a tree of nodes: variable references are resolved to
+ * frame slots or global cells, the arity of special forms is checked
+ * and every node gets the handler which evaluates it.
+ */
+enum nodetype { NODECONST, NODELOCAL, NODEGLOBAL, NODELAMBDA, NODEDEFINE,
+	NODESET, NODEIF, NODEBEGIN, NODECALL, NODEFUTURE, NODEPCALL
+};
+
+#define NNODETYPES (NODEPCALL + 1)
+
+/*
+ * An analyzed expression. `eval' evaluates the node *np in the
+ * environment *enp. A handler which ends in a tail position stores the
+ * node and environment to continue with in *np and *enp and returns
+ * NULL instead of a value.
+ */
+typedef struct node {
+	value(*eval) (struct interp * ip, struct node ** np, env ** enp);
+	enum nodetype type;
+	struct node *next;
+	union {
+		value constant;
+		struct {
+			int depth;
+			int slot;
+			lookupcache cache;
+		};
+		struct dictentry *cell;
+		struct {
+			symbol *target;
+			struct node *valuenode;
+		};
+		struct {
+			struct node *test;
+			struct node *then;
+			struct node *otherwise;
+		};
+		struct node *body;
+		struct {
+			/* The operator, followed by the arguments. */
+			struct node *args;
+			int argc;
+		};
+		struct {
+			/* See FUTURES. */
+			struct node *task;
+			struct code *taskcode;
+			/* Created by pcall; it is touched before the call. */
+			bool implicit;
+		};
+		struct {
+			lambdainfo *info;
+			value lambdavars;
+			value lambdaexpr;
+		};
+	};
+} node;
+
+/*
+ * Every expr, env and dictentry is allocated from the pool for its type.
+ * Pools get their memory in slabs: SLAB_SIZE aligned blocks which start
+ * with a header, so the header of an object is found by masking its
+ * address. The heap has two generations:
+ *  - The nursery. New objects are bump allocated in young slabs. A minor
+ *    collection copies the surviving young objects into the old
+ *    generation and resets the nursery. In young slabs, `marks' holds
+ *    the forwarding bits and the forwarding address is stored in the
+ *    first word of the original object.
+ *  - The old generation. Free objects in old slabs are linked through
+ *    their first word. A major collection marks the old generation and
+ *    sweeps the slabs.
+ * Old objects which get a pointer to a young object are recorded in the
+ * remembered set by `gc_write_barrier'. They are roots for a minor
+ * collection.
+ */
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MIN_OBJSIZE 16
+/*
+ * Values tag pointers in their low three bits, so every object must be
+ * 8 byte aligned. Slabs are, and objects start at a multiple of
+ * SLAB_MIN_OBJSIZE, so the size of pooled objects is rounded up to a
+ * multiple of 8; on 32 bit targets an expr is 20 bytes.
+ */
+#define POOL_ALIGN 8
+#define POOL_OBJSIZE(type) (sizeof(type) < SLAB_MIN_OBJSIZE \
+	? SLAB_MIN_OBJSIZE : (sizeof(type) + POOL_ALIGN - 1) \
+	& ~(size_t) (POOL_ALIGN - 1))
+_Static_assert(SLAB_MIN_OBJSIZE % POOL_ALIGN == 0,
+	       "slab objects must be aligned for tagged values");
+#define SLAB_MAX_OBJECTS (SLAB_SIZE / SLAB_MIN_OBJSIZE)
+#define SLAB_BITMAP_WORDS (SLAB_MAX_OBJECTS / 32)
+
+struct pool;
 
-typedef struct expr_list {
-	expr *exprptr;
-	struct expr_list *next;
-} expr_list;
+typedef struct slab {
+	struct slab *next;
+	struct pool *pool;
+	char *objects;
+	size_t nobjects;
+	bool young;
+	unsigned int marks[SLAB_BITMAP_WORDS];
+	unsigned int remembered[SLAB_BITMAP_WORDS];
+} slab;
 
-/* This stores every expression created with `create_expr'. */
-static expr_list *saved_expressions;
+/* The objects of a slab start after the header. */
+#define SLAB_HEADER_SIZE ((sizeof(slab) + SLAB_MIN_OBJSIZE - 1) \
+	& ~(size_t) (SLAB_MIN_OBJSIZE - 1))
 
-typedef struct env_list {
-	env *envptr;
-	struct env_list *next;
-} env_list;
+/* Called by the collector with the address of a pointer field. */
+typedef void (*gc_visitor) (struct interp *, void **);
 
-/* This stores every environment created with `create_env'. */
-static env_list *saved_environments;
+typedef struct pool {
+	const char *name;
+	size_t objsize;
+	/* Calls visit for every heap pointer in an object. */
+	void (*trace) (struct interp * ip, void *obj, gc_visitor visit);
+	/* Releases memory an object owns outside of the heap; may be NULL. */
+	void (*finalize) (struct interp * ip, void *obj);
+	/* The index in `pools'. */
+	int id;
+	/* The old generation. */
+	slab *slabs;
+	void *free_list;
+	size_t nobjects;
+	size_t nfree;
+	/*
+	 * The nursery. Every thread bump allocates in a slab of its own,
+	 * see `allocbuf'.
+	 */
+	slab *nursery;
+} pool;
 
-void print_expr(expr *);
+static void trace_expr(struct interp *, void *, gc_visitor);
+static void trace_env(struct interp *, void *, gc_visitor);
+static void trace_dict(struct interp *, void *, gc_visitor);
+static void trace_node(struct interp *, void *, gc_visitor);
+static void trace_pair(struct interp *, void *, gc_visitor);
+static void finalize_expr(struct interp *, void *);
+static void finalize_env(struct interp *, void *);
+
+/* The pools of every interpreter, in the order of interp.pools. */
+static const pool pool_types[] = {
+	{"expressions", POOL_OBJSIZE(expr), trace_expr, finalize_expr, 0},
+	{"environments", POOL_OBJSIZE(env), trace_env, finalize_env, 1},
+	{"dict entries", POOL_OBJSIZE(dictentry), trace_dict, NULL, 2},
+	{"nodes", POOL_OBJSIZE(node), trace_node, NULL, 3},
+	{"pairs", POOL_OBJSIZE(pair), trace_pair, NULL, 4},
+};
+
+#define NPOOLS (sizeof(pool_types) / sizeof(pool_types[0]))
 
 /*
- * Frees an environment structure as well as the enclosed dictionary.
- * Params:
- *   e : the env struct to freed.
- * Returns:
- *   the total size of bytes freed.
+ * Bytecode for the virtual machine, compiled from a lambda body or a
+ * top-level form. The constants are values and binding cells which the
+ * instructions refer to. They are taken from the node tree the code
+ * was compiled from, its `owner', so the code is alive as long as that
+ * tree.
  */
-size_t free_env(env * e)
-{
-	size_t byte_count = 0;
-	dictentry *dictptr = e->list;
-	dictentry *tmp;
-	while (dictptr != NULL) {
-		tmp = dictptr->next;
-		free(dictptr);
-		dictptr = tmp;
-		byte_count += sizeof(dictentry);
-	}
-	free(e);
-	return byte_count += sizeof(env);
-}
+typedef struct code {
+	intptr_t *ops;
+	size_t len, capacity;
+	value *consts;
+	size_t nconsts, consts_capacity;
+	int maxstack;
+	struct node *owner;
+} code;
 
 /*
- * Save an expression pointer for the garbage collection.
- * Params:
- *   e : the expression pointer to be saved.
+ * Counters of the runtime. They are always on and cost an increment
+ * each; the `stats' procedure reads them and --stats prints them at
+ * exit. Every thread counts in its own struct; they are summed up when
+ * the counters are read.
+ */
+struct counters {
+	size_t evals[NNODETYPES];	/* Evaluated nodes by type. */
+	size_t applications;	/* Lambda applications. */
+	size_t proc_calls;	/* Builtin procedure calls. */
+	size_t lookups;		/* Calls of find_in_dict. */
+	size_t hops;		/* Frames searched by find_in_dict. */
+	size_t allocations[NPOOLS];	/* Allocated objects by pool. */
+};
+
+/* The nursery slab in which a thread allocates objects of a pool. */
+typedef struct allocbuf {
+	slab *slab;
+	char *bump;
+	char *bump_end;
+} allocbuf;
+
+#define DEQUE_SIZE 1024
+
+/*
+ * A work-stealing deque of futures, see FUTURES. The owner pushes and
+ * pops at the bottom, other threads steal from the top. The futures
+ * from top to bottom are roots.
+ */
+typedef struct deque {
+	long top;
+	long bottom;
+	struct expr *tasks[DEQUE_SIZE];
+} deque;
+
+/*
+ * The state of a thread in an interpreter: its main thread or a worker of
+ * its thread pool. The collector scans the roots of every thread.
+ */
+typedef struct worker {
+	/*
+	 * The shadow stack. It holds the addresses of C variables which
+	 * point to heap objects and have to survive a garbage collection,
+	 * e.g. the arguments of eval. Together with global_env these are
+	 * the only roots. Since a minor collection moves objects, the
+	 * variables are updated.
+	 */
+	void ***roots;
+	size_t nroots;
+	size_t roots_capacity;
+	/*
+	 * The value stack holds intermediate values of the evaluation,
+	 * e.g. the evaluated arguments of a procedure call. All values
+	 * below vstack_top are roots.
+	 */
+	value *vstack;
+	size_t vstack_top;
+	size_t vstack_capacity;
+	allocbuf alloc[NPOOLS];
+	struct counters counters;
+	deque tasks;
+	/* False while the thread waits; see gc_stop_world. */
+	bool running;
+	unsigned int seed;	/* Picks the deques to steal from. */
+	struct interp *ip;
+	pthread_t thread;
+} worker;
+
+#define MAX_WORKERS 256
+
+/*
+ * A native procedure, as registered by miniclisp_define_native. Images
+ * refer to native procedures by name; see IMAGES.
+ */
+typedef struct native {
+	symbol *name;
+	miniclisp_native proc;
+	int arity;
+	void *data;
+} native;
+
+/*
+ * An image which an interpreter has mapped. Its area holds slabs of
+ * the heap and the memory which lambdas, frames, bignums and vectors
+ * own; see IMAGES.
+ */
+typedef struct imagemap {
+	char *map;
+	size_t len;
+	char *area;
+	size_t area_size;
+} imagemap;
+
+/*
+ * An interpreter. It owns everything the evaluation works on: the global
+ * environment, the symbols, the heap and its collector, and the thread
+ * pool. Interpreters share nothing, so several of them can run in one
+ * process at the same time, each on threads of its own. Every function
+ * which allocates, evaluates or interns receives its interpreter. Only
+ * the output buffer and the profiler are global, like the stdout and
+ * the signal timer they stand for.
+ */
+typedef struct interp {
+	env *global_env;
+	size_t global_version;	/* See lookupcache. */
+
+	/* The symbol table; a chained hash table which owns every symbol. */
+	symbol **symtab;
+	size_t symtab_size;
+	size_t symtab_count;
+
+	/* Symbols which are compared by eval and the arithmetic procedures. */
+	symbol *sym_define;
+	symbol *sym_set;
+	symbol *sym_quote;
+	symbol *sym_if;
+	symbol *sym_begin;
+	symbol *sym_lambda;
+	symbol *sym_future;
+	symbol *sym_pcall;
+	symbol *sym_true;
+	symbol *sym_false;
+
+	pool expr_pool;
+	pool env_pool;
+	pool dict_pool;
+	pool node_pool;
+	pool pair_pool;
+	pool *pools[NPOOLS];
+
+	/* Slabs which are not in use; the nursery takes its slabs from here. */
+	slab *free_slabs;
+
+	/*
+	 * The lambdas of the analyzed code. Their bodies are roots of a
+	 * minor collection; a major collection frees the lambdas it does
+	 * not reach.
+	 */
+	lambdainfo **lambdas;
+	size_t nlambdas;
+	size_t lambdas_capacity;
+
+	/*
+	 * All code objects; their constants are roots of a minor
+	 * collection. Top-level code is removed again after it ran, other
+	 * code lives as long as its owner.
+	 */
+	code **codes;
+	size_t ncodes;
+	size_t codes_capacity;
+
+	/* The remembered set. */
+	void **gc_remembered;
+	size_t gc_nremembered;
+	size_t gc_remembered_capacity;
+
+	/* Objects which have been reached but not traced yet. */
+	void **gc_gray;
+	size_t gc_ngray;
+	size_t gc_gray_capacity;
+
+	/*
+	 * A minor collection runs at the next safe point once the nursery
+	 * slabs exceed gc_nursery_size bytes. A major collection runs once
+	 * the old generation exceeds gc_threshold bytes. After each major
+	 * collection, the threshold is set to gc_growth times the surviving
+	 * heap size, but at least gc_min_heap bytes.
+	 */
+	size_t gc_nursery_size;
+	size_t gc_young_bytes;
+	size_t gc_heap_bytes;
+	size_t gc_threshold;
+	size_t gc_min_heap;
+	double gc_growth;
+	bool gc_minor_pending;
+	bool gc_major_pending;
+
+	/* The counters of the collector, which runs on one thread at a time. */
+	struct {
+		size_t minor_gcs;
+		size_t major_gcs;
+		size_t gc_ns;	/* The total GC pause time. */
+		size_t gc_max_ns;	/* The longest GC pause. */
+	} gc_counters;
+
+	/* The thread which created the interpreter is the first worker. */
+	worker main_worker;
+	worker *workers[MAX_WORKERS];
+	int nworkers;
+
+	/*
+	 * Set when the thread pool is started. Until then, the interpreter
+	 * takes no locks.
+	 */
+	bool threaded;
+
+	/*
+	 * The heap lock protects the slab lists, the remembered set and the
+	 * state of the collector. A collection stops the world: the
+	 * collecting thread holds the heap lock until every other thread is
+	 * parked at a safe point or waits in a blocking call.
+	 */
+	pthread_mutex_t heap_mutex;
+	pthread_cond_t gc_parked_cond;
+	pthread_cond_t gc_done_cond;
+	bool gc_stopping;
+
+	pthread_mutex_t env_mutex;	/* See env_lock. */
+
+	/* The thread pool, see FUTURES. */
+	int worker_count;	/* 1 disables the pool. */
+	long task_grain;	/* The maximum number of queued futures. */
+	long tasks_queued;	/* The futures in all deques. */
+	int idle_workers;	/* The workers which wait for a future. */
+	pthread_cond_t work_cond;
+	bool closing;		/* Set by interp_free. */
+
+	/* Use the tree-walking evaluator instead of the virtual machine. */
+	bool use_tree_walker;
+
+	/* The registry of native procedures. */
+	native *natives;
+	size_t nnatives;
+	size_t natives_capacity;
+
+	/* The images which have been loaded, see load_image. */
+	imagemap *images;
+	size_t nimages;
+} interp;
+
+/*
+ * The worker of the current thread in the interpreter it runs; see
+ * interp_enter.
+ */
+static __thread worker *self;
+
+/*
+ * Let the current thread evaluate in an interpreter. A thread which is
+ * not a worker of the interpreter becomes its main thread. Only one
+ * thread at a time may do so.
  * Returns:
- *   the pointer to the expr_list entry where e was stored.
+ *   the previous worker of the thread, for interp_leave.
  */
-expr_list *gc_collect_expr(expr * e)
+static inline worker *interp_enter(interp * ip)
 {
-	if (e == NULL)
-		return NULL;
+	worker *prev = self;
+	if (self == NULL || self->ip != ip)
+		self = &ip->main_worker;
+	return prev;
+}
+
+/* Return to the interpreter the thread ran before interp_enter. */
+static inline void interp_leave(worker * prev)
+{
+	if (prev != NULL)
+		self = prev;
+}
+
+static inline void heap_lock(interp * ip)
+{
+	if (ip->threaded)
+		pthread_mutex_lock(&ip->heap_mutex);
+}
 
-	expr_list *tmp = malloc(sizeof(expr_list));
-	tmp->exprptr = e;
-	tmp->next = NULL;
+static inline void heap_unlock(interp * ip)
+{
+	if (ip->threaded)
+		pthread_mutex_unlock(&ip->heap_mutex);
+}
+
+/* A monotonic clock in seconds. */
+static inline double clock_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	debug_info("Collecting expression pointer %p.\n", e);
+void print_expr(expr *);
 
-	if (saved_expressions == NULL)
-		return saved_expressions = tmp;
+/*
+ * FNV-1a hash of a (not necessarily NUL-terminated) string.
+ */
+static unsigned int hash_name(const char *s, size_t len)
+{
+	unsigned int h = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
 
-	expr_list *listptr = saved_expressions;
-	while (listptr->next != NULL) {
-		if (listptr->exprptr == e) {
-			free(tmp);
-			return listptr;
+/*
+ * Double the size of the symbol table and rehash every symbol.
+ */
+static void symtab_grow(interp * ip)
+{
+	size_t new_size = ip->symtab_size == 0 ? 256 : ip->symtab_size * 2;
+	symbol **new_tab = calloc(new_size, sizeof(symbol *));
+	size_t i;
+	for (i = 0; i < ip->symtab_size; i++) {
+		symbol *s = ip->symtab[i];
+		while (s != NULL) {
+			symbol *next = s->next;
+			size_t idx = s->hash & (new_size - 1);
+			s->next = new_tab[idx];
+			new_tab[idx] = s;
+			s = next;
 		}
-		listptr = listptr->next;
 	}
-	return listptr->next = tmp;
+	free(ip->symtab);
+	ip->symtab = new_tab;
+	ip->symtab_size = new_size;
 }
 
 /*
- * Save an environment pointer for the garbate collection.
+ * Return the unique symbol for a name, creating it if necessary.
+ * Symbols are never freed.
  * Params:
- *   e : the environment pointer to be saved.
+ *   name : the symbol name; doesn't have to be NUL-terminated.
+ *   len : the length of name.
  * Returns:
- *  the pointer to the env_list entry where e was stored;
- * TODO: Remove redundancy with gc_collect_expr; somehow...
+ *   the interned symbol.
  */
-env_list *gc_collect_env(env * e)
+symbol *intern_n(interp * ip, const char *name, size_t len)
 {
-	if (e == NULL)
-		return NULL;
+	unsigned int h = hash_name(name, len);
+	symbol *s;
 
-	env_list *tmp = malloc(sizeof(env_list));
-	tmp->envptr = e;
-	tmp->next = NULL;
+	if (ip->symtab_size != 0) {
+		s = ip->symtab[h & (ip->symtab_size - 1)];
+		while (s != NULL) {
+			if (s->hash == h && s->len == len
+			    && memcmp(s->name, name, len) == 0)
+				return s;
+			s = s->next;
+		}
+	}
 
-	debug_info("Collecting environment pointer %p.\n", e);
+	if (ip->symtab_count >= ip->symtab_size / 2)
+		symtab_grow(ip);
 
-	if (saved_environments == NULL)
-		return saved_environments = tmp;
+	s = malloc(sizeof(symbol));
+	s->name = malloc(len + 1);
+	memcpy(s->name, name, len);
+	s->name[len] = 0;
+	s->len = len;
+	s->hash = h;
+	s->expr = NULL;
+	s->next = ip->symtab[h & (ip->symtab_size - 1)];
+	ip->symtab[h & (ip->symtab_size - 1)] = s;
+	ip->symtab_count++;
 
-	env_list *listptr = saved_environments;
-	while (listptr->next != NULL) {
-		if (listptr->envptr == e)
-			return listptr;
-		listptr = listptr->next;
-	}
-	return listptr->next = tmp;
+	return s;
+}
+
+symbol *intern(interp * ip, const char *name)
+{
+	return intern_n(ip, name, strlen(name));
 }
 
 /*
- * Mark an expression recursively as in_use. This includes
- * every subexpression if it's an expression list.
- * Param:
- *   e : a pointer to the expression which should be marked.
+ * Intern the symbols which have a special meaning for the interpreter.
  */
-void gc_mark_expr(expr * e)
+void init_symbols(interp * ip)
 {
-	if (e == NULL || e->in_use == true)
-		return;
+	ip->sym_define = intern(ip, "define");
+	ip->sym_set = intern(ip, "set!");
+	ip->sym_quote = intern(ip, "quote");
+	ip->sym_if = intern(ip, "if");
+	ip->sym_begin = intern(ip, "begin");
+	ip->sym_lambda = intern(ip, "lambda");
+	ip->sym_future = intern(ip, "future");
+	ip->sym_pcall = intern(ip, "pcall");
+	ip->sym_true = intern(ip, TRUE);
+	ip->sym_false = intern(ip, FALSE);
+}
 
-	e->in_use = true;
+/**        OUTPUT: **/
 
-	if (e->type == EXPRLIST) {
-		expr *listentry = e->listptr;
-		while (listentry != NULL) {
-			gc_mark_expr(listentry);
-			listentry = listentry->next;
-		}
+/*
+ * Everything the interpreter prints to stdout is collected in one large
+ * buffer, which is written when it is full, by out_flush() and at exit.
+ * It is shared by all interpreters and locked.
+ */
+#define OUTPUT_BUFSIZE (1024 * 1024)
+
+static char out_buf[OUTPUT_BUFSIZE];
+static size_t out_len;
+static pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void out_flush_locked()
+{
+	fwrite(out_buf, 1, out_len, stdout);
+	fflush(stdout);
+	out_len = 0;
+}
+
+void out_flush()
+{
+	pthread_mutex_lock(&out_mutex);
+	out_flush_locked();
+	pthread_mutex_unlock(&out_mutex);
+}
+
+static void out_write(const char *s, size_t len)
+{
+	pthread_mutex_lock(&out_mutex);
+	if (len > OUTPUT_BUFSIZE - out_len) {
+		out_flush_locked();
+		if (len > OUTPUT_BUFSIZE)
+			fwrite(s, 1, len, stdout);
 	}
+	if (len <= OUTPUT_BUFSIZE) {
+		memcpy(out_buf + out_len, s, len);
+		out_len += len;
+	}
+	pthread_mutex_unlock(&out_mutex);
+}
+
+static inline void out_str(const char *s)
+{
+	out_write(s, strlen(s));
 }
 
+static inline void out_char(char c)
+{
+	out_write(&c, 1);
+}
+
+/* Print an integer in decimal without going through printf. */
+void out_int(long long int i)
+{
+	char digits[24];
+	char *p = digits + sizeof(digits);
+	unsigned long long int u = i < 0 ? -(unsigned long long int)i : i;
+
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+	if (i < 0)
+		*--p = '-';
+	out_write(p, digits + sizeof(digits) - p);
+}
+
+void out_printf(const char *fmt, ...)
+{
+	char tmp[256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	if (len > 0)
+		out_write(tmp, len < (int)sizeof(tmp) ? len : sizeof(tmp) - 1);
+}
+
+/**        PROFILER: **/
+
 /*
- * Runs the garbage collection. This is a simple mark-and-sweep
- * garbage collector. First, the in_use flag for every saved expression
- * and environment is set to false and then we traverse the
- * environment (starting with current_env) and mark every found
- * expression and environment as in_use.
- * Afterwards, every struct which is not in_use will be freed as well as
- * the corresponding entries in the saved_expressions and
- * saved_environments lists.
- *
- * IMPORTANT: Don't use `free()' on expr and env pointers anywhere else
- * in this program.
- *
- * Params:
- *   unused : for compatibility with the other Scheme procedures.
- * Returns:
- *   NULL; for compatibility
+ * A sampling profiler. While it is enabled, the evaluators keep a stack
+ * of the lambdas being applied (a tail call replaces the top), and a
+ * SIGPROF timer copies that stack into the sample buffer. At exit, the
+ * samples are written as collapsed stacks, one line per distinct stack
+ * with its count, which flame graph tools read. When it is disabled,
+ * the evaluators only test `profiling'. Every thread has a stack of its
+ * own; a sample is taken of the thread which gets the signal.
  */
-expr *gc(expr * unused)
-{
-	printf("Running garbage collection...\n");
+#define PROF_MAX_DEPTH 256
+#define PROF_BUFSIZE (4 * 1024 * 1024)
+#define PROF_INTERVAL_US 1000
 
-	if (saved_expressions == NULL || saved_environments == NULL)
-		return NULL;
+static bool profiling;
+static const char *prof_path;
 
-	/* MARK */
+/* The names of the lambdas; lambdas themselves may be collected. */
+static __thread symbol *volatile prof_stack[PROF_MAX_DEPTH];
+static __thread volatile size_t prof_depth;
+/* The depth at which the innermost eval_node started. */
+static __thread size_t prof_base;
 
-	expr_list *exprlistptr = saved_expressions;
-	env_list *envlistptr = saved_environments;
+/* Samples are stored as a depth followed by that many stack entries. */
+static uintptr_t *prof_buf;
+static volatile size_t prof_len;
+static volatile size_t prof_dropped;
 
-	int max_exprs = 0;
-	int max_envs = 0;
+/*
+ * Enter a lambda.
+ * Params:
+ *   name : the name of the lambda or NULL.
+ *   tail : replace the lambda on top of the stack.
+ */
+static inline void prof_enter(symbol * name, bool tail)
+{
+	if (!tail)
+		prof_depth++;
+	if (prof_depth <= PROF_MAX_DEPTH)
+		prof_stack[prof_depth - 1] = name;
+}
 
-	/* Mark all exprs and envs as unused. */
-	do {
-		exprlistptr->exprptr->in_use = false;
-		max_exprs++;
-	} while ((exprlistptr = exprlistptr->next) != NULL);
+static void prof_sample(int sig)
+{
+	size_t depth = prof_depth, i;
+	if (depth > PROF_MAX_DEPTH)
+		depth = PROF_MAX_DEPTH;
+	/* Reserve the space; other threads may take samples, too. */
+	size_t pos = prof_len;
 	do {
-		envlistptr->envptr->in_use = false;
-		max_envs++;
-	} while ((envlistptr = envlistptr->next) != NULL);
-
-	/* Find all used environments and used expressions. */
-	env *envptr = current_env;
-	dictentry *dictptr;
-	while (envptr != NULL) {
-		dictptr = envptr->list;
-		while (dictptr != NULL) {
-			gc_mark_expr(dictptr->sym);
-			gc_mark_expr(dictptr->value);
-			dictptr = dictptr->next;
+		if (pos + depth + 1 > PROF_BUFSIZE) {
+			__atomic_fetch_add(&prof_dropped, 1, __ATOMIC_RELAXED);
+			return;
 		}
+	} while (!__atomic_compare_exchange_n(&prof_len, &pos, pos + depth + 1,
+					      false, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	prof_buf[pos] = depth;
+	for (i = 0; i < depth; i++)
+		prof_buf[pos + 1 + i] = (uintptr_t) prof_stack[i];
+}
 
-		envptr->in_use = true;
-		envptr = envptr->outer;
-	}
+static int compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-	/* SWEEP */
+/* Write the samples as collapsed stacks; installed with atexit. */
+static void prof_write()
+{
+	struct itimerval off = { {0, 0}, {0, 0} };
+	setitimer(ITIMER_PROF, &off, NULL);
 
-	int count_expr = 0, count_env = 0, byte_count_env = 0;
-	exprlistptr = saved_expressions;
-	envlistptr = saved_environments;
-
-	expr_list *tmp_expr;
-	env_list *tmp_env;
-
-	expr_list *prev_expr = NULL;
-	env_list *prev_env = NULL;
-
-	/* Free each unused expr and env. */
-	while (exprlistptr != NULL) {
-		if (!exprlistptr->exprptr->in_use) {
-			/* Free the expr if it's  not in_use: */
-			free(exprlistptr->exprptr);
-			/* Free the corresponding struct in the list: */
-			tmp_expr = exprlistptr->next;
-			free(exprlistptr);
-			/* Update the next-pointer of the previous expr: */
-			if (prev_expr == NULL) {
-				saved_expressions = tmp_expr;
-				prev_expr = saved_expressions;
-			} else {
-				prev_expr->next = tmp_expr;
-			}
-			exprlistptr = tmp_expr;
-			count_expr++;
-		} else {
-			exprlistptr = exprlistptr->next;
-			if (prev_expr == NULL)
-				prev_expr = saved_expressions;
-			else
-				prev_expr = prev_expr->next;
-		}
-	}
-	while (envlistptr != NULL) {
-		if (!envlistptr->envptr->in_use) {
-			byte_count_env += free_env(envlistptr->envptr);
-			tmp_env = envlistptr->next;
-			free(envlistptr);
-			if (prev_env == NULL) {
-				saved_environments = tmp_env;
-				prev_env = saved_environments;
-			} else
-				prev_env->next = tmp_env;
-			envlistptr = tmp_env;
-			count_env++;
-		} else {
-			envlistptr = envlistptr->next;
-			if (prev_env == NULL)
-				prev_env = saved_environments;
-			else
-				prev_env = prev_env->next;
+	FILE *f = fopen(prof_path, "w");
+	if (f == NULL) {
+		print_err("Could not open %s.\n", prof_path);
+		return;
+	}
+
+	size_t nlines = 0, capacity = 0, pos, i;
+	char **lines = NULL;
+	for (pos = 0; pos < prof_len; pos += prof_buf[pos] + 1) {
+		size_t depth = prof_buf[pos], len = 0;
+		char *line = NULL;
+		FILE *out = open_memstream(&line, &len);
+		fputs("toplevel", out);
+		for (i = 0; i < depth; i++) {
+			symbol *name = (symbol *) prof_buf[pos + 1 + i];
+			fprintf(out, ";%s",
+				name != NULL ? name->name : "lambda");
 		}
+		fclose(out);
+		if (nlines == capacity) {
+			capacity = capacity == 0 ? 1024 : capacity * 2;
+			lines = realloc(lines, capacity * sizeof(char *));
+		}
+		lines[nlines++] = line;
 	}
 
-	printf("Garbage collection done.\n");
-	printf
-	    ("Freed %d/%d expressions (%d bytes).\n", count_expr, max_exprs,
-	     count_expr * sizeof(expr));
-	printf("Freed %d/%d environments (%d bytes).\n", count_env, max_envs,
-	       byte_count_env);
-	return NULL;
+	qsort(lines, nlines, sizeof(char *), compare_strings);
+	for (i = 0; i < nlines; i = pos) {
+		for (pos = i + 1;
+		     pos < nlines && strcmp(lines[pos], lines[i]) == 0; pos++)
+			free(lines[pos]);
+		fprintf(f, "%s %zu\n", lines[i], pos - i);
+		free(lines[i]);
+	}
+	if (prof_dropped > 0)
+		print_err("The profile buffer was full: %zu samples dropped.\n",
+			  (size_t)prof_dropped);
+	free(lines);
+	fclose(f);
 }
 
-expr *find_in_dict(expr * e, env * en)
+/* Start sampling; the profile is written to path at exit. */
+void prof_start(const char *path)
 {
-	if (e == NULL || en == NULL)
-		return NULL;
-	dictentry *d = en->list;
-	while (d != NULL) {
-		if (strcmp(e->symvalue, d->sym->symvalue) == 0)
-			return d->value;
-		d = d->next;
-	}
-	return find_in_dict(e, en->outer);
+	struct sigaction sa;
+	struct itimerval timer = { {0, PROF_INTERVAL_US}, {0, PROF_INTERVAL_US} };
+
+	prof_path = path;
+	prof_buf = malloc(PROF_BUFSIZE * sizeof(uintptr_t));
+	profiling = true;
+	atexit(prof_write);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = prof_sample;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGPROF, &sa, NULL);
+	setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static inline slab *slab_of(const void *obj)
+{
+	return (slab *) ((uintptr_t) obj & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+static inline size_t slab_index(const slab * sl, const void *obj)
+{
+	return ((const char *)obj - sl->objects) / sl->pool->objsize;
 }
 
 /*
- * Returns the i-th entry of an expr list.
- * Params:
- *   i : the number of the requested entry. 0 is the list head.
+ * Set bit i of a bitmap.
  * Returns:
- *   a pointer to the list entry i or NULL if none was found.
+ *   true if the bit was already set.
  */
-expr *get_next(expr * e, int i)
+static inline bool bitmap_set(unsigned int *bitmap, size_t i)
 {
-	if (e == NULL || e->type != EXPRLIST || i < 0)
-		return NULL;
+	unsigned int bit = 1u << (i % 32);
+	if (bitmap[i / 32] & bit)
+		return true;
+	bitmap[i / 32] |= bit;
+	return false;
+}
 
-	int counter = 0;
-	expr *current = e->listptr;
-	while (current != NULL) {
-		if (counter == i)
-			return current;
-		current = current->next;
-		counter++;
+/* Immediate values are never young. */
+static inline bool gc_is_young(const void *obj)
+{
+	return obj != NULL && ((uintptr_t) obj & 3) == 0
+	    && slab_of(obj)->young;
+}
+
+/*
+ * Get an empty slab for a pool, either a cached or a new one.
+ */
+static slab *slab_new(interp * ip, pool * p, bool young)
+{
+	slab *sl = ip->free_slabs;
+	if (sl != NULL) {
+		ip->free_slabs = sl->next;
+	} else {
+		void *mem;
+		if (posix_memalign(&mem, SLAB_SIZE, SLAB_SIZE) != 0) {
+			print_err("%s", "Out of memory.\n");
+			exit(-1);
+		}
+		sl = mem;
+	}
+
+	sl->pool = p;
+	sl->young = young;
+	sl->objects = (char *)sl + SLAB_HEADER_SIZE;
+	sl->nobjects = (SLAB_SIZE - SLAB_HEADER_SIZE) / p->objsize;
+	memset(sl->marks, 0, sizeof(sl->marks));
+	memset(sl->remembered, 0, sizeof(sl->remembered));
+	return sl;
+}
+
+/*
+ * Add a new slab to the old generation of a pool and put all of its
+ * objects on the free list.
+ */
+static void pool_grow(interp * ip, pool * p)
+{
+	slab *sl = slab_new(ip, p, false);
+	sl->next = p->slabs;
+	p->slabs = sl;
+
+	size_t i = sl->nobjects;
+	while (i-- > 0) {
+		void **obj = (void **)(sl->objects + i * p->objsize);
+		*obj = p->free_list;
+		p->free_list = obj;
+	}
+	p->nobjects += sl->nobjects;
+	p->nfree += sl->nobjects;
+}
+
+/*
+ * Allocate an object in the old generation. The caller holds the heap
+ * lock.
+ */
+static void *pool_alloc_old(interp * ip, pool * p)
+{
+	if (p->free_list == NULL)
+		pool_grow(ip, p);
+
+	void **obj = p->free_list;
+	p->free_list = *obj;
+	p->nfree--;
+	if ((ip->gc_heap_bytes += p->objsize) > ip->gc_threshold)
+		__atomic_store_n(&ip->gc_major_pending, true, __ATOMIC_RELAXED);
+	return obj;
+}
+
+/*
+ * Stop allocating in the slab of an allocation buffer. Its object count
+ * is cut down to the objects which have been allocated.
+ */
+static void allocbuf_retire(pool * p, allocbuf * b)
+{
+	if (b->slab != NULL)
+		b->slab->nobjects = (b->bump - b->slab->objects) / p->objsize;
+	b->slab = NULL;
+	b->bump = b->bump_end = NULL;
+}
+
+/*
+ * Start a new nursery slab for a pool in an allocation buffer of the
+ * current thread.
+ */
+static void nursery_grow(interp * ip, pool * p, allocbuf * b)
+{
+	heap_lock(ip);
+	allocbuf_retire(p, b);
+	slab *sl = slab_new(ip, p, true);
+	sl->next = p->nursery;
+	p->nursery = sl;
+	if ((ip->gc_young_bytes += SLAB_SIZE) > ip->gc_nursery_size)
+		__atomic_store_n(&ip->gc_minor_pending, true, __ATOMIC_RELAXED);
+	heap_unlock(ip);
+
+	b->slab = sl;
+	b->bump = sl->objects;
+	b->bump_end = sl->objects + sl->nobjects * p->objsize;
+}
+
+/*
+ * Allocate a new object in the nursery. Every thread has its own
+ * allocation buffers, so this takes no lock.
+ */
+static inline void *pool_alloc(interp * ip, pool * p)
+{
+	allocbuf *b = &self->alloc[p->id];
+	if (b->bump == b->bump_end)
+		nursery_grow(ip, p, b);
+
+	void *obj = b->bump;
+	b->bump += p->objsize;
+	self->counters.allocations[p->id]++;
+	return obj;
+}
+
+/*
+ * Retire the allocation buffers of all threads, so the nursery slabs
+ * know their object counts. Called by the collector.
+ */
+static void nursery_retire(interp * ip)
+{
+	int i;
+	size_t j;
+	for (i = 0; i < ip->nworkers; i++) {
+		for (j = 0; j < NPOOLS; j++)
+			allocbuf_retire(ip->pools[j],
+					&ip->workers[i]->alloc[j]);
+	}
+}
+
+/* Number of objects which are in use in a pool. */
+static size_t pool_live(const pool * p)
+{
+	size_t count = p->nobjects - p->nfree;
+	slab *sl;
+	for (sl = p->nursery; sl != NULL; sl = sl->next)
+		count += sl->nobjects;
+	return count;
+}
+
+static void gc_push(void ***stack, size_t * count, size_t * capacity,
+		   void *ptr)
+{
+	if (*count == *capacity) {
+		*capacity = *capacity == 0 ? 256 : *capacity * 2;
+		*stack = realloc(*stack, *capacity * sizeof(void *));
+	}
+	(*stack)[(*count)++] = ptr;
+}
+
+/*
+ * Register a C variable as a root. Roots are released in LIFO order by
+ * resetting the shadow stack to a size returned by `gc_roots_save':
+ *   size_t roots = gc_roots_save();
+ *   gc_root_expr(&e);
+ *   ...
+ *   gc_roots_restore(roots);
+ * A variable which is a root may be moved by the garbage collection, so
+ * pointers derived from it have to be reloaded after a safe point.
+ */
+static inline void gc_root_expr(expr ** ref)
+{
+	gc_push((void ***)&self->roots, &self->nroots, &self->roots_capacity,
+		ref);
+}
+
+static inline void gc_root_env(env ** ref)
+{
+	gc_push((void ***)&self->roots, &self->nroots, &self->roots_capacity,
+		ref);
+}
+
+static inline void gc_root_node(node ** ref)
+{
+	gc_push((void ***)&self->roots, &self->nroots, &self->roots_capacity,
+		ref);
+}
+
+/*
+ * Register a lambda. It is freed by the first major collection which
+ * does not reach its body.
+ */
+static inline void gc_add_lambda(interp * ip, lambdainfo * info)
+{
+	gc_push((void ***)&ip->lambdas, &ip->nlambdas, &ip->lambdas_capacity,
+		info);
+}
+
+static inline void gc_root_value(value * ref)
+{
+	gc_push((void ***)&self->roots, &self->nroots, &self->roots_capacity,
+		ref);
+}
+
+static inline size_t gc_roots_save()
+{
+	return self->nroots;
+}
+
+static inline void gc_roots_restore(size_t roots)
+{
+	self->nroots = roots;
+}
+
+/*
+ * Make room for n more values on the value stack. This may move the
+ * stack.
+ */
+static inline void vstack_reserve(size_t n)
+{
+	if (self->vstack_top + n > self->vstack_capacity) {
+		while (self->vstack_top + n > self->vstack_capacity)
+			self->vstack_capacity = self->vstack_capacity == 0
+			    ? 1024 : self->vstack_capacity * 2;
+		self->vstack = realloc(self->vstack, self->vstack_capacity
+				       * sizeof(value));
+	}
+}
+
+static inline void vstack_push(value v)
+{
+	vstack_reserve(1);
+	self->vstack[self->vstack_top++] = v;
+}
+
+/*
+ * The write barrier. Has to be called whenever a heap pointer is stored
+ * in an object which might be old, i.e. in any object which was not
+ * allocated since the last safe point.
+ * Params:
+ *   holder : the object which was written to.
+ *   value : the pointer which was stored.
+ */
+static inline void gc_write_barrier(interp * ip, void *holder,
+				    const void *value)
+{
+	if (gc_is_young(value) && !slab_of(holder)->young) {
+		slab *sl = slab_of(holder);
+		size_t i = slab_index(sl, holder);
+		unsigned int bit = 1u << (i % 32);
+		/* Other threads may set bits of the same word. */
+		if ((sl->remembered[i / 32] & bit)
+		    || (__atomic_fetch_or(&sl->remembered[i / 32], bit,
+					  __ATOMIC_RELAXED) & bit))
+			return;
+		heap_lock(ip);
+		gc_push(&ip->gc_remembered, &ip->gc_nremembered,
+			&ip->gc_remembered_capacity, holder);
+		heap_unlock(ip);
+	}
+}
+
+static void trace_expr(interp * ip, void *obj, gc_visitor visit)
+{
+	expr *e = obj;
+	if (e->type == EXPRLAMBDA) {
+		visit(ip, (void **)&e->lambdavars);
+		visit(ip, (void **)&e->lambdaexpr);
+		visit(ip, (void **)&e->lambdaenv);
+		visit(ip, (void **)&e->lambdainfo->body);
+	} else if (e->type == EXPRFUTURE) {
+		visit(ip, (void **)&e->task);
+		visit(ip, (void **)&e->taskenv);
+		visit(ip, (void **)&e->result);
+	}
+}
+
+static void trace_env(interp * ip, void *obj, gc_visitor visit)
+{
+	env *en = obj;
+	size_t i;
+	visit(ip, (void **)&en->outer);
+	for (i = 0; i < en->capacity; i++) {
+		if (en->entries[i] != NULL)
+			visit(ip, (void **)&en->entries[i]);
+	}
+}
+
+static void trace_dict(interp * ip, void *obj, gc_visitor visit)
+{
+	dictentry *d = obj;
+	visit(ip, (void **)&d->value);
+}
+
+static void trace_pair(interp * ip, void *obj, gc_visitor visit)
+{
+	pair *p = obj;
+	visit(ip, (void **)&p->car);
+	visit(ip, (void **)&p->cdr);
+}
+
+static void trace_node(interp * ip, void *obj, gc_visitor visit)
+{
+	node *n = obj;
+	visit(ip, (void **)&n->next);
+	switch (n->type) {
+	case NODECONST:
+		visit(ip, (void **)&n->constant);
+		break;
+	case NODEGLOBAL:
+		visit(ip, (void **)&n->cell);
+		break;
+	case NODEDEFINE:
+	case NODESET:
+		visit(ip, (void **)&n->valuenode);
+		break;
+	case NODEIF:
+		visit(ip, (void **)&n->test);
+		visit(ip, (void **)&n->then);
+		visit(ip, (void **)&n->otherwise);
+		break;
+	case NODEBEGIN:
+		visit(ip, (void **)&n->body);
+		break;
+	case NODECALL:
+	case NODEPCALL:
+		visit(ip, (void **)&n->args);
+		break;
+	case NODEFUTURE:
+		visit(ip, (void **)&n->task);
+		break;
+	case NODELAMBDA:
+		visit(ip, (void **)&n->lambdavars);
+		visit(ip, (void **)&n->lambdaexpr);
+		visit(ip, (void **)&n->info->body);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Returns whether memory belongs to one of the images an interpreter
+ * has loaded. It must not be passed to free.
+ */
+static bool image_contains(interp * ip, const void *p)
+{
+	size_t i;
+	for (i = 0; i < ip->nimages; i++) {
+		if ((const char *)p >= ip->images[i].area
+		    && (const char *)p < ip->images[i].area
+		    + ip->images[i].area_size)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Release the memory an environment owns outside of the pools.
+ */
+static void finalize_expr(interp * ip, void *obj)
+{
+	expr *e = obj;
+	if (e->type == EXPRBIG && !image_contains(ip, e->digits))
+		free(e->digits);
+	else if (e->type == EXPRVECTOR && !image_contains(ip, e->elements))
+		free(e->elements);
+}
+
+static void finalize_env(interp * ip, void *obj)
+{
+	env *e = obj;
+	if (!image_contains(ip, e->entries))
+		free(e->entries);
+}
+
+/*
+ * Copy a young object into the old generation, unless this has already
+ * happened. Old objects are returned unchanged. A pair may be passed as
+ * a tagged value; the tag is kept.
+ * Returns:
+ *   the new address of obj.
+ */
+static void *gc_forward(interp * ip, void *obj)
+{
+	if (!gc_is_young(obj))
+		return obj;
+
+	uintptr_t tag = (uintptr_t) obj & PAIR_TAG;
+	obj = (char *)obj - tag;
+	slab *sl = slab_of(obj);
+	if (bitmap_set(sl->marks, slab_index(sl, obj)))
+		return *(char **)obj + tag;
+
+	void *copy = pool_alloc_old(ip, sl->pool);
+	memcpy(copy, obj, sl->pool->objsize);
+	*(void **)obj = copy;
+	gc_push(&ip->gc_gray, &ip->gc_ngray, &ip->gc_gray_capacity, copy);
+	return (char *)copy + tag;
+}
+
+static void gc_visit_minor(interp * ip, void **field)
+{
+	*field = gc_forward(ip, *field);
+}
+
+/*
+ * Free all nursery slabs of a pool. Objects which have not been copied
+ * into the old generation are dead.
+ */
+static void nursery_reset(interp * ip, pool * p)
+{
+	slab *sl, *next;
+	size_t i;
+	for (sl = p->nursery; sl != NULL; sl = next) {
+		next = sl->next;
+		if (p->finalize != NULL) {
+			for (i = 0; i < sl->nobjects; i++) {
+				if (!(sl->marks[i / 32] & (1u << (i % 32))))
+					p->finalize(ip, sl->objects +
+						    i * p->objsize);
+			}
+		}
+		sl->next = ip->free_slabs;
+		ip->free_slabs = sl;
+	}
+	p->nursery = NULL;
+}
+
+/*
+ * Call visit for every root: global_env and the shadow stacks, value
+ * stacks and deques of all threads. The frames of the virtual machine
+ * keep the owners of their code on the value stack.
+ */
+static void gc_visit_roots(interp * ip, gc_visitor visit)
+{
+	size_t i;
+	int w;
+	long t;
+
+	visit(ip, (void **)&ip->global_env);
+	for (w = 0; w < ip->nworkers; w++) {
+		worker *wk = ip->workers[w];
+		for (i = 0; i < wk->nroots; i++)
+			visit(ip, wk->roots[i]);
+		for (i = 0; i < wk->vstack_top; i++)
+			visit(ip, (void **)&wk->vstack[i]);
+		for (t = wk->tasks.top; t < wk->tasks.bottom; t++)
+			visit(ip, (void **)&wk->tasks.tasks[t % DEQUE_SIZE]);
+	}
+}
+
+/*
+ * Runs a minor collection. Every young object which is reachable from
+ * the roots or the remembered set is copied into the old generation
+ * (breadth first, with the gray stack) and the pointers to it are
+ * updated. Afterwards the nursery is empty. The lambda bodies and the
+ * code objects refer to nodes without a write barrier, so they are
+ * roots as well; only a major collection finds out which of them are
+ * garbage.
+ */
+void gc_minor(interp * ip)
+{
+	size_t i, j;
+
+	ip->gc_counters.minor_gcs++;
+	ip->global_version++;
+	nursery_retire(ip);
+	gc_visit_roots(ip, gc_visit_minor);
+	for (i = 0; i < ip->nlambdas; i++)
+		gc_visit_minor(ip, (void **)&ip->lambdas[i]->body);
+	for (i = 0; i < ip->ncodes; i++) {
+		code *c = ip->codes[i];
+		gc_visit_minor(ip, (void **)&c->owner);
+		for (j = 0; j < c->nconsts; j++)
+			gc_visit_minor(ip, (void **)&c->consts[j]);
+	}
+	for (i = 0; i < ip->gc_nremembered; i++) {
+		void *obj = ip->gc_remembered[i];
+		slab *sl = slab_of(obj);
+		size_t idx = slab_index(sl, obj);
+		sl->remembered[idx / 32] &= ~(1u << (idx % 32));
+		sl->pool->trace(ip, obj, gc_visit_minor);
+	}
+	ip->gc_nremembered = 0;
+
+	while (ip->gc_ngray > 0) {
+		void *obj = ip->gc_gray[--ip->gc_ngray];
+		slab_of(obj)->pool->trace(ip, obj, gc_visit_minor);
+	}
+
+	for (i = 0; i < NPOOLS; i++)
+		nursery_reset(ip, ip->pools[i]);
+	ip->gc_young_bytes = 0;
+	__atomic_store_n(&ip->gc_minor_pending, false, __ATOMIC_RELAXED);
+
+	debug_info("Old generation after minor collection: %zu bytes.\n",
+		   ip->gc_heap_bytes);
+}
+
+static void gc_visit_major(interp * ip, void **field)
+{
+	void *obj = *field;
+	if (obj == NULL || ((uintptr_t) obj & 3) != 0)
+		return;
+	obj = (char *)obj - ((uintptr_t) obj & PAIR_TAG);
+	slab *sl = slab_of(obj);
+	if (!bitmap_set(sl->marks, slab_index(sl, obj)))
+		gc_push(&ip->gc_gray, &ip->gc_ngray, &ip->gc_gray_capacity,
+			obj);
+}
+
+/*
+ * Free every unmarked object in the old generation of a pool and clear
+ * all mark bits. Objects which are already on the free list are marked
+ * first, so that only garbage is left unmarked.
+ * Returns:
+ *   the number of freed objects.
+ */
+static size_t pool_sweep(interp * ip, pool * p)
+{
+	void **obj;
+	for (obj = p->free_list; obj != NULL; obj = *obj)
+		bitmap_set(slab_of(obj)->marks, slab_index(slab_of(obj), obj));
+
+	size_t count = 0;
+	slab *sl;
+	for (sl = p->slabs; sl != NULL; sl = sl->next) {
+		size_t i;
+		for (i = 0; i < sl->nobjects; i++) {
+			if (sl->marks[i / 32] & (1u << (i % 32)))
+				continue;
+			obj = (void **)(sl->objects + i * p->objsize);
+			if (p->finalize != NULL)
+				p->finalize(ip, obj);
+			*obj = p->free_list;
+			p->free_list = obj;
+			count++;
+		}
+		memset(sl->marks, 0, sizeof(sl->marks));
+	}
+	p->nfree += count;
+	ip->gc_heap_bytes -= count * p->objsize;
+	return count;
+}
+
+static bool gc_is_marked(const void *obj)
+{
+	slab *sl = slab_of(obj);
+	size_t i = slab_index(sl, obj);
+	return (sl->marks[i / 32] & (1u << (i % 32))) != 0;
+}
+
+/*
+ * Free the code objects whose owner and the lambdas whose body has not
+ * been marked. Called after the mark phase, when all nodes are old.
+ * Lambda code is owned by the body, so it goes together with its
+ * lambda.
+ */
+static void gc_sweep_lambdas(interp * ip)
+{
+	size_t i;
+
+	for (i = ip->ncodes; i-- > 0;) {
+		code *c = ip->codes[i];
+		if (gc_is_marked(c->owner))
+			continue;
+		ip->codes[i] = ip->codes[--ip->ncodes];
+		free(c->ops);
+		free(c->consts);
+		free(c);
+	}
+	for (i = ip->nlambdas; i-- > 0;) {
+		lambdainfo *info = ip->lambdas[i];
+		if (gc_is_marked(info->body))
+			continue;
+		ip->lambdas[i] = ip->lambdas[--ip->nlambdas];
+		if (image_contains(ip, info))
+			continue;
+		free(info->slots);
+		free(info->free);
+		free(info);
+	}
+}
+
+/* Statistics about a garbage collection; indexed like `pools'. */
+typedef struct gcstats {
+	size_t live_before[NPOOLS];
+	size_t live_after[NPOOLS];
+} gcstats;
+
+/*
+ * Runs a major collection. This starts with a minor collection, so the
+ * nursery is empty. Then we traverse everything reachable from
+ * global_env and the shadow stack and set the mark bit of every
+ * reachable object. Afterwards, the slabs of every pool are scanned and
+ * all unmarked objects are put back on the free lists, and the lambdas
+ * and code objects of unmarked nodes are freed.
+ *
+ * IMPORTANT: Don't use `free()' on expr and env pointers anywhere else
+ * in this program. Every expr or env pointer which is held in a C
+ * variable across a call to `eval' has to be registered as a root.
+ *
+ * Params:
+ *   stats : filled with the number of live objects; may be NULL.
+ */
+void gc_major(interp * ip, gcstats * stats)
+{
+	size_t i;
+
+	ip->gc_counters.major_gcs++;
+	nursery_retire(ip);
+	if (stats != NULL) {
+		for (i = 0; i < NPOOLS; i++)
+			stats->live_before[i] = pool_live(ip->pools[i]);
+	}
+
+	gc_minor(ip);
+
+	/* MARK */
+	gc_visit_roots(ip, gc_visit_major);
+	for (i = 0; i < ip->symtab_size; i++) {
+		symbol *s;
+		for (s = ip->symtab[i]; s != NULL; s = s->next)
+			gc_visit_major(ip, (void **)&s->expr);
+	}
+	while (ip->gc_ngray > 0) {
+		void *obj = ip->gc_gray[--ip->gc_ngray];
+		slab_of(obj)->pool->trace(ip, obj, gc_visit_major);
+	}
+
+	/* SWEEP */
+	gc_sweep_lambdas(ip);
+	for (i = 0; i < NPOOLS; i++)
+		pool_sweep(ip, ip->pools[i]);
+
+	ip->gc_threshold = ip->gc_heap_bytes * ip->gc_growth;
+	if (ip->gc_threshold < ip->gc_min_heap)
+		ip->gc_threshold = ip->gc_min_heap;
+	__atomic_store_n(&ip->gc_major_pending, false, __ATOMIC_RELAXED);
+
+	debug_info("Heap after collection: %zu bytes, next at %zu bytes.\n",
+		   ip->gc_heap_bytes, ip->gc_threshold);
+	if (stats != NULL) {
+		for (i = 0; i < NPOOLS; i++)
+			stats->live_after[i] = pool_live(ip->pools[i]);
+	}
+}
+
+/* Account for a GC pause which started at `start'. */
+static void gc_pause_end(interp * ip, double start)
+{
+	size_t ns = (clock_seconds() - start) * 1e9;
+	ip->gc_counters.gc_ns += ns;
+	if (ns > ip->gc_counters.gc_max_ns)
+		ip->gc_counters.gc_max_ns = ns;
+}
+
+/*
+ * Park the current thread until the collection of another thread is
+ * done. The caller holds the heap lock.
+ */
+static void gc_park(interp * ip)
+{
+	self->running = false;
+	pthread_cond_broadcast(&ip->gc_parked_cond);
+	while (ip->gc_stopping)
+		pthread_cond_wait(&ip->gc_done_cond, &ip->heap_mutex);
+	self->running = true;
+}
+
+/*
+ * Stop the world for a collection by the current thread: wait until
+ * every other thread is parked. Nothing is stopped if another thread is
+ * collecting already; then the current thread is parked until it is
+ * done.
+ * Params:
+ *   major : request a major collection.
+ * Returns:
+ *   true if the current thread may collect. Then it holds the heap lock
+ *   until gc_start_world.
+ */
+static bool gc_stop_world(interp * ip, bool major)
+{
+	int i;
+
+	if (!ip->threaded)
+		return true;
+	pthread_mutex_lock(&ip->heap_mutex);
+	if (ip->gc_stopping) {
+		gc_park(ip);
+		pthread_mutex_unlock(&ip->heap_mutex);
+		return false;
+	}
+	if (major)
+		__atomic_store_n(&ip->gc_major_pending, true, __ATOMIC_RELAXED);
+	if (!ip->gc_minor_pending && !ip->gc_major_pending) {
+		/* Another thread has collected in the meantime. */
+		pthread_mutex_unlock(&ip->heap_mutex);
+		return false;
+	}
+	ip->gc_stopping = true;
+	for (i = 0; i < ip->nworkers; i++) {
+		while (ip->workers[i] != self && ip->workers[i]->running)
+			pthread_cond_wait(&ip->gc_parked_cond, &ip->heap_mutex);
+	}
+	return true;
+}
+
+static void gc_start_world(interp * ip)
+{
+	if (!ip->threaded)
+		return;
+	ip->gc_stopping = false;
+	pthread_cond_broadcast(&ip->gc_done_cond);
+	pthread_mutex_unlock(&ip->heap_mutex);
+}
+
+/*
+ * Let other threads collect while the current thread waits in a
+ * blocking call, e.g. for input. Until gc_unblock, the thread must not
+ * touch the heap; its roots are updated by a collection.
+ */
+static void gc_block(interp * ip)
+{
+	if (!ip->threaded)
+		return;
+	pthread_mutex_lock(&ip->heap_mutex);
+	self->running = false;
+	pthread_cond_broadcast(&ip->gc_parked_cond);
+	pthread_mutex_unlock(&ip->heap_mutex);
+}
+
+static void gc_unblock(interp * ip)
+{
+	if (!ip->threaded)
+		return;
+	pthread_mutex_lock(&ip->heap_mutex);
+	while (ip->gc_stopping)
+		pthread_cond_wait(&ip->gc_done_cond, &ip->heap_mutex);
+	self->running = true;
+	pthread_mutex_unlock(&ip->heap_mutex);
+}
+
+/* Run the pending collection; see gc_safepoint. */
+static void gc_collect(interp * ip)
+{
+	if (!gc_stop_world(ip, false))
+		return;
+
+	double start = clock_seconds();
+	if (ip->gc_minor_pending && !ip->gc_major_pending)
+		gc_minor(ip);
+	if (ip->gc_major_pending)
+		gc_major(ip, NULL);
+	gc_pause_end(ip, start);
+	gc_start_world(ip);
+}
+
+/*
+ * A safe point for the garbage collection: runs a pending minor or major
+ * collection. Must only be called when every live expr and env is
+ * reachable from the roots. With the thread pool, the collection waits
+ * until every thread has reached a safe point.
+ */
+static inline void gc_safepoint(interp * ip)
+{
+	if (!__atomic_load_n(&ip->gc_minor_pending, __ATOMIC_RELAXED)
+	    && !__atomic_load_n(&ip->gc_major_pending, __ATOMIC_RELAXED))
+		return;
+	gc_collect(ip);
+}
+
+/*
+ * The `gc' procedure. Runs a major collection and prints some
+ * statistics.
+ * Returns:
+ *   the empty value.
+ */
+value gc(interp * ip, int argc, value * argv)
+{
+	gcstats st;
+
+	out_str("Running garbage collection...\n");
+	while (!gc_stop_world(ip, true)) ;
+	double start = clock_seconds();
+	gc_major(ip, &st);
+	gc_pause_end(ip, start);
+	gc_start_world(ip);
+
+	size_t exprs = st.live_before[0] - st.live_after[0];
+	size_t envs = st.live_before[1] - st.live_after[1];
+	size_t dicts = st.live_before[2] - st.live_after[2];
+	size_t pairs = st.live_before[4] - st.live_after[4];
+	out_str("Garbage collection done.\n");
+	out_printf("Freed %zu/%zu expressions (%zu bytes).\n", exprs,
+	       st.live_before[0], exprs * sizeof(expr));
+	out_printf("Freed %zu/%zu environments (%zu bytes).\n", envs,
+	       st.live_before[1], envs * sizeof(env)
+	       + dicts * sizeof(dictentry));
+	out_printf("Freed %zu/%zu pairs (%zu bytes).\n", pairs,
+		   st.live_before[4], pairs * sizeof(pair));
+	return VAL_EMPTY;
+}
+
+/*
+ * With the thread pool, hash table frames, i.e. the global environment,
+ * are searched and changed under the environment lock. It is recursive,
+ * so add_to_env can hold it across the lookup and the insertion. Lambda
+ * frames never grow, so their slots are accessed without it.
+ */
+static inline void env_lock(interp * ip)
+{
+	if (ip->threaded)
+		pthread_mutex_lock(&ip->env_mutex);
+}
+
+static inline void env_unlock(interp * ip)
+{
+	if (ip->threaded)
+		pthread_mutex_unlock(&ip->env_mutex);
+}
+
+/*
+ * Find the binding of a symbol in a single environment frame.
+ * Params:
+ *   en : the frame to search. Its outer frames are not searched.
+ *   s : the symbol to look up.
+ * Returns:
+ *   the dict entry for s or NULL if s is not bound in en.
+ */
+dictentry *env_lookup(interp * ip, env * en, symbol * s)
+{
+	size_t i;
+	if (!en->hashed) {
+		for (i = 0; i < en->count; i++) {
+			if (en->entries[i]->sym == s)
+				return en->entries[i];
+		}
+		return NULL;
+	}
+	dictentry *d = NULL;
+	env_lock(ip);
+	size_t mask = en->capacity - 1;
+	for (i = s->hash & mask; en->entries[i] != NULL; i = (i + 1) & mask) {
+		if (en->entries[i]->sym == s) {
+			d = en->entries[i];
+			break;
+		}
+	}
+	env_unlock(ip);
+	return d;
+}
+
+/*
+ * Insert a dict entry into a hash table of the given size. The caller
+ * has to make sure that there is a free slot.
+ */
+static void env_hash_insert(dictentry ** table, size_t capacity,
+			    dictentry * d)
+{
+	size_t mask = capacity - 1;
+	size_t i;
+	for (i = d->sym->hash & mask; table[i] != NULL; i = (i + 1) & mask) ;
+	table[i] = d;
+}
+
+/*
+ * Grow the storage of an environment frame so that at least one more
+ * binding fits in. Small frames are converted into a hash table as soon
+ * as they would exceed ENV_SMALL_MAX bindings. Hash tables are kept at
+ * a load factor of at most 1/2.
+ */
+static void env_grow(interp * ip, env * en)
+{
+	size_t i;
+	if (!en->hashed && en->count < ENV_SMALL_MAX) {
+		size_t capacity = en->capacity == 0 ? 2 : en->capacity * 2;
+		if (capacity > ENV_SMALL_MAX)
+			capacity = ENV_SMALL_MAX;
+		if (image_contains(ip, en->entries)) {
+			dictentry **entries =
+			    malloc(capacity * sizeof(dictentry *));
+			memcpy(entries, en->entries,
+			       en->capacity * sizeof(dictentry *));
+			en->entries = entries;
+		} else
+			en->entries =
+			    realloc(en->entries, capacity * sizeof(dictentry *));
+		for (i = en->capacity; i < capacity; i++)
+			en->entries[i] = NULL;
+		en->capacity = capacity;
+		return;
+	}
+
+	size_t capacity = en->hashed ? en->capacity * 2 : 4 * ENV_SMALL_MAX;
+	dictentry **table = calloc(capacity, sizeof(dictentry *));
+	for (i = 0; i < en->capacity; i++) {
+		if (en->entries[i] != NULL)
+			env_hash_insert(table, capacity, en->entries[i]);
+	}
+	if (!image_contains(ip, en->entries))
+		free(en->entries);
+	en->entries = table;
+	en->capacity = capacity;
+	en->hashed = true;
+}
+
+value find_in_dict(interp * ip, symbol * s, env * en)
+{
+	self->counters.lookups++;
+	while (en != NULL) {
+		dictentry *d = env_lookup(ip, en, s);
+		self->counters.hops++;
+		if (d != NULL && d->value != NULL)
+			return d->value;
+		en = en->outer;
+	}
+	return NULL;
+}
+
+/*
+ * Look up a variable in the frames from outer outward, like find_in_dict,
+ * through an inline cache.
+ */
+static value find_cached(interp * ip, lookupcache * c, symbol * s, env * outer)
+{
+	env *en;
+
+	/* The caches are not shared between threads. */
+	if (ip->threaded)
+		return find_in_dict(ip, s, outer);
+	if (c->version == ip->global_version && c->outer == outer)
+		return c->cell->value;
+
+	self->counters.lookups++;
+	for (en = outer; en != NULL; en = en->outer) {
+		dictentry *d = env_lookup(ip, en, s);
+		self->counters.hops++;
+		if (d != NULL && d->value != NULL) {
+			c->version = ip->global_version;
+			c->outer = outer;
+			c->cell = d;
+			return d->value;
+		}
+	}
+	return NULL;
+}
+
+static inline value car(value v)
+{
+	return value_pair(v)->car;
+}
+
+static inline value cdr(value v)
+{
+	return value_pair(v)->cdr;
+}
+
+/*
+ * Returns the i-th entry of a list.
+ * Params:
+ *   i : the number of the requested entry. 0 is the list head.
+ * Returns:
+ *   the list entry i or NULL if none was found.
+ */
+value get_next(value l, int i)
+{
+	if (i < 0)
+		return NULL;
+	for (; is_pair(l); l = cdr(l)) {
+		if (i-- == 0)
+			return car(l);
+	}
+	return NULL;
+}
+
+/*
+ * Return the length of a list.
+ * Returns:
+ *   the length of the list or -1 if l is not a proper list, i.e. a
+ *   chain of pairs which ends in VAL_EMPTY.
+ */
+int get_list_size(value l)
+{
+	int counter = 0;
+	for (; is_pair(l); l = cdr(l))
+		counter++;
+	return l == VAL_EMPTY ? counter : -1;
+}
+
+/* Returns the symbol of a value or NULL if it is not a symbol. */
+static inline symbol *get_symbol(value v)
+{
+	expr *e = value_expr(v);
+	return e != NULL && e->type == EXPRSYM ? e->symvalue : NULL;
+}
+
+void out_big(expr * e);
+void _print_value(value v, bool verbose);
+
+void _print_expr(expr * e, bool verbose)
+{
+	if (e == NULL) {
+		print_err("%s", "Argument e is NULL.");
+	} else if (e->type == EXPRINT || e->type == EXPRBIG) {
+		if (verbose)
+			out_str(" INT: ");
+		if (e->type == EXPRINT)
+			out_int(e->intvalue);
+		else
+			out_big(e);
+		if (verbose)
+			out_char(' ');
+	} else if (e->type == EXPRVECTOR) {
+		size_t i;
+		out_str(verbose ? " EXPRVECTOR[" : "#(");
+		for (i = 0; i < e->length; i++) {
+			if (i > 0)
+				out_char(' ');
+			out_int(e->elements[i]);
+		}
+		out_str(verbose ? "] " : ")");
+	} else if (e->type == EXPRPROC) {
+		out_printf(" PROC: %p ", e->proc);
+	} else if (e->type == EXPRNATIVE) {
+		out_printf(" NATIVE: %p ", e->native);
+	} else if (e->type == EXPRFUTURE) {
+		out_str(verbose ? " FUTURE " : "#<future>");
+	} else if (e->type == EXPRLAMBDA) {
+		out_str("[LAMBDA EXPR ARGS:");
+		_print_value(e->lambdavars, verbose);
+		out_str(" BODY ");
+		_print_value(e->lambdaexpr, verbose);
+		out_char(']');
+	} else if (verbose) {
+		out_str(" SYM:'");
+		out_str(e->symvalue->name);
+		out_str("' ");
+	} else {
+		out_str(e->symvalue->name);
+	}
+}
+
+void print_expr(expr * e)
+{
+	_print_expr(e, true);
+	out_char('\n');
+}
+
+void _print_value(value v, bool verbose)
+{
+	if (is_fixnum(v)) {
+		if (verbose)
+			out_str(" INT: ");
+		out_int(get_int(v));
+		if (verbose)
+			out_char(' ');
+	} else if (v == VAL_TRUE || v == VAL_FALSE) {
+		if (verbose)
+			out_str(" SYM:'");
+		out_str(v == VAL_TRUE ? TRUE : FALSE);
+		if (verbose)
+			out_str("' ");
+	} else if (v == VAL_EMPTY) {
+		out_str(verbose ? "()" : " [] ");
+	} else if (is_pair(v)) {
+		out_str(verbose ? " EXPRLIST[" : "(");
+		for (;;) {
+			_print_value(car(v), verbose);
+			v = cdr(v);
+			if (!is_pair(v))
+				break;
+			if (!verbose)
+				out_char(' ');
+		}
+		if (v != VAL_EMPTY) {
+			out_str(" . ");
+			_print_value(v, verbose);
+		}
+		out_str(verbose ? "] " : ")");
+	} else {
+		_print_expr(value_expr(v), verbose);
+	}
+}
+
+void print_value(value v)
+{
+	_print_value(v, true);
+	out_char('\n');
+}
+
+void print_value_debug(value v)
+{
+	if (DEBUG)
+		print_value(v);
+}
+
+/*
+ * Create a new environment frame.
+ * Params:
+ *   outer : the enclosing environment or NULL.
+ *   size_hint : the expected number of bindings, e.g. the number of
+ *               lambda parameters. The frame grows if necessary.
+ */
+static env *create_env(interp * ip, env * outer, size_t size_hint)
+{
+	env *new = pool_alloc(ip, &ip->env_pool);
+	new->outer = outer;
+	new->count = 0;
+	new->hashed = false;
+	new->capacity = size_hint < ENV_SMALL_MAX ? size_hint : ENV_SMALL_MAX;
+	new->entries = NULL;
+	if (new->capacity > 0)
+		new->entries = calloc(new->capacity, sizeof(dictentry *));
+
+	return new;
+}
+
+static expr *create_expr(interp * ip, enum exprtype type)
+{
+	expr *new = pool_alloc(ip, &ip->expr_pool);
+	memset(new, 0, sizeof(expr));
+	new->type = type;
+
+	return new;
+}
+
+/*
+ * Create a pair. Like every other allocation, this does not collect, so
+ * car and cdr need not be roots.
+ */
+static value cons(interp * ip, value car, value cdr)
+{
+	pair *new = pool_alloc(ip, &ip->pair_pool);
+	new->car = car;
+	new->cdr = cdr;
+
+	return (value) ((uintptr_t) new + PAIR_TAG);
+}
+
+static expr *create_exprproc(interp * ip,
+			     value(*proc) (interp *, int, value *))
+{
+	expr *new = create_expr(ip, EXPRPROC);
+	new->proc = proc;
+
+	return new;
+}
+
+static expr *create_exprnative(interp * ip, const native * n)
+{
+	expr *new = create_expr(ip, EXPRNATIVE);
+	new->native = n->proc;
+	new->arity = n->arity;
+	new->data = n->data;
+	new->nativename = n->name;
+
+	return new;
+}
+
+/*
+ * Returns the EXPRSYM of a symbol. Every symbol has only one, so each
+ * occurrence of a symbol in the code or in quoted data costs a pointer.
+ * It is allocated in the old generation and marked by every major
+ * collection.
+ */
+expr *create_exprsym(interp * ip, symbol * s)
+{
+	if (s->expr == NULL) {
+		heap_lock(ip);
+		expr *new = pool_alloc_old(ip, &ip->expr_pool);
+		heap_unlock(ip);
+		memset(new, 0, sizeof(expr));
+		new->type = EXPRSYM;
+		new->symvalue = s;
+		s->expr = new;
+	}
+	return s->expr;
+}
+
+expr *create_exprint(interp * ip, long long int i)
+{
+	expr *new = create_expr(ip, EXPRINT);
+	new->intvalue = i;
+
+	return new;
+}
+
+/*
+ * Returns the value of an integer: a fixnum if it fits, otherwise a
+ * boxed EXPRINT.
+ */
+value make_int(interp * ip, long long int i)
+{
+	if (i >= FIXNUM_MIN && i <= FIXNUM_MAX)
+		return make_fixnum(i);
+	return (value) create_exprint(ip, i);
+}
+
+/**        BIGNUMS: **/
+
+/*
+ * Integers which do not fit into a long long are bignums: an EXPRBIG
+ * with a sign and a magnitude of 32 bit digits, least significant
+ * first and without leading zeros. The digits are malloc'd and freed by
+ * the finalizer of the expr pool. Results which fit into a long long
+ * are always turned back into a fixnum or a boxed integer.
+ *
+ * The mag_ functions compute on magnitudes, which may have leading
+ * zeros.
+ */
+typedef uint32_t digit;
+
+/* Factors with at least this many digits are multiplied by Karatsuba. */
+#define KARATSUBA_THRESHOLD 32
+
+/* The sign and magnitude of an integer of any size. */
+typedef struct bigview {
+	const digit *digits;
+	size_t ndigits;
+	bool negative;
+	digit buf[2];		/* The magnitude of a long long. */
+} bigview;
+
+static void big_view(value v, bigview * bv)
+{
+	if (is_int(v)) {
+		long long int i = get_int(v);
+		unsigned long long int u = i < 0 ? -(unsigned long long int)i : i;
+		bv->buf[0] = (digit) u;
+		bv->buf[1] = (digit) (u >> 32);
+		bv->digits = bv->buf;
+		bv->ndigits = bv->buf[1] != 0 ? 2 : bv->buf[0] != 0;
+		bv->negative = i < 0;
+	} else {
+		expr *e = value_expr(v);
+		bv->digits = e->digits;
+		bv->ndigits = e->ndigits;
+		bv->negative = e->negative;
+	}
+}
+
+/* The length of a magnitude without leading zeros. */
+static inline size_t mag_len(const digit * d, size_t n)
+{
+	while (n > 0 && d[n - 1] == 0)
+		n--;
+	return n;
+}
+
+static int mag_cmp(const digit * a, size_t na, const digit * b, size_t nb)
+{
+	na = mag_len(a, na);
+	nb = mag_len(b, nb);
+	if (na != nb)
+		return na < nb ? -1 : 1;
+	while (na-- > 0) {
+		if (a[na] != b[na])
+			return a[na] < b[na] ? -1 : 1;
+	}
+	return 0;
+}
+
+/* r = a + b with na >= nb; r has na + 1 digits. */
+static void mag_add(digit * r, const digit * a, size_t na, const digit * b,
+		    size_t nb)
+{
+	uint64_t carry = 0;
+	size_t i;
+	for (i = 0; i < na; i++) {
+		carry += (uint64_t) a[i] + (i < nb ? b[i] : 0);
+		r[i] = (digit) carry;
+		carry >>= 32;
+	}
+	r[na] = (digit) carry;
+}
+
+/* r = a - b with a >= b; r has na digits and may be a. */
+static void mag_sub(digit * r, const digit * a, size_t na, const digit * b,
+		    size_t nb)
+{
+	uint64_t borrow = 0;
+	size_t i;
+	for (i = 0; i < na; i++) {
+		uint64_t t = (uint64_t) a[i] - (i < nb ? b[i] : 0) - borrow;
+		r[i] = (digit) t;
+		borrow = t >> 63;
+	}
+}
+
+/* r += t; the sum must fit into the nr digits of r. */
+static void mag_add_in(digit * r, size_t nr, const digit * t, size_t nt)
+{
+	uint64_t carry = 0;
+	size_t i;
+	nt = mag_len(t, nt);
+	for (i = 0; i < nr && (i < nt || carry != 0); i++) {
+		carry += (uint64_t) r[i] + (i < nt ? t[i] : 0);
+		r[i] = (digit) carry;
+		carry >>= 32;
+	}
+}
+
+/* r = a * b by the schoolbook method; r has na + nb digits. */
+static void mag_mul_school(digit * r, const digit * a, size_t na,
+			   const digit * b, size_t nb)
+{
+	size_t i, j;
+	memset(r, 0, (na + nb) * sizeof(digit));
+	for (i = 0; i < na; i++) {
+		uint64_t carry = 0;
+		for (j = 0; j < nb; j++) {
+			carry += (uint64_t) a[i] * b[j] + r[i + j];
+			r[i + j] = (digit) carry;
+			carry >>= 32;
+		}
+		r[i + nb] = (digit) carry;
+	}
+}
+
+/*
+ * r = a * b; r has na + nb digits. Large factors are split in halves,
+ * a = a1 B^m + a0 and b = b1 B^m + b0, and multiplied with three
+ * recursive products instead of four (Karatsuba):
+ *   a b = z2 B^2m + ((a0 + a1)(b0 + b1) - z2 - z0) B^m + z0
+ * with z2 = a1 b1 and z0 = a0 b0.
+ */
+static void mag_mul(digit * r, const digit * a, size_t na, const digit * b,
+		    size_t nb)
+{
+	if (na < nb) {
+		const digit *t = a;
+		size_t nt = na;
+		a = b;
+		na = nb;
+		b = t;
+		nb = nt;
+	}
+	if (nb < KARATSUBA_THRESHOLD) {
+		mag_mul_school(r, a, na, b, nb);
+		return;
+	}
+
+	size_t m = (na + 1) / 2;
+	if (nb <= m) {
+		/* b is short: r = a0 b + a1 b B^m. */
+		digit *t = malloc((na - m + nb) * sizeof(digit));
+		mag_mul(r, a, m, b, nb);
+		memset(r + m + nb, 0, (na - m) * sizeof(digit));
+		mag_mul(t, a + m, na - m, b, nb);
+		mag_add_in(r + m, na + nb - m, t, na - m + nb);
+		free(t);
+		return;
+	}
+
+	digit *sa = malloc((m + 1) * sizeof(digit));
+	digit *sb = malloc((m + 1) * sizeof(digit));
+	digit *z1 = malloc((2 * m + 2) * sizeof(digit));
+	mag_add(sa, a, m, a + m, na - m);
+	mag_add(sb, b, m, b + m, nb - m);
+	mag_mul(z1, sa, m + 1, sb, m + 1);
+	mag_mul(r, a, m, b, m);
+	mag_mul(r + 2 * m, a + m, na - m, b + m, nb - m);
+	mag_sub(z1, z1, 2 * m + 2, r, 2 * m);
+	mag_sub(z1, z1, 2 * m + 2, r + 2 * m, na + nb - 2 * m);
+	mag_add_in(r + m, na + nb - m, z1, 2 * m + 2);
+	free(sa);
+	free(sb);
+	free(z1);
+}
+
+/*
+ * Make an integer value of a magnitude. The value takes ownership of
+ * the digits.
+ */
+static value big_result(interp * ip, digit * d, size_t n, bool negative)
+{
+	n = mag_len(d, n);
+	if (n <= 2) {
+		unsigned long long int u = n == 0 ? 0 : d[0];
+		if (n == 2)
+			u |= (unsigned long long int)d[1] << 32;
+		if (u <= LLONG_MAX || (negative && u - 1 == LLONG_MAX)) {
+			free(d);
+			return make_int(ip, negative ? (long long int)-u
+					: (long long int)u);
+		}
+	}
+	expr *e = create_expr(ip, EXPRBIG);
+	e->digits = d;
+	e->ndigits = n;
+	e->negative = negative;
+	return (value) e;
+}
+
+/* a + b, or a - b if subtract is set. */
+static value num_add(interp * ip, value a, value b, bool subtract)
+{
+	long long int r;
+	if (is_int(a) && is_int(b)
+	    && !(subtract ? __builtin_sub_overflow(get_int(a), get_int(b), &r)
+		 : __builtin_add_overflow(get_int(a), get_int(b), &r)))
+		return make_int(ip, r);
+
+	bigview va, vb, *x = &va, *y = &vb;
+	big_view(a, &va);
+	big_view(b, &vb);
+	vb.negative ^= subtract;
+	if (x->ndigits < y->ndigits) {
+		x = &vb;
+		y = &va;
+	}
+
+	digit *d = malloc((x->ndigits + 1) * sizeof(digit));
+	if (x->negative == y->negative) {
+		mag_add(d, x->digits, x->ndigits, y->digits, y->ndigits);
+		return big_result(ip, d, x->ndigits + 1, x->negative);
+	}
+	if (mag_cmp(x->digits, x->ndigits, y->digits, y->ndigits) < 0) {
+		bigview *t = x;
+		x = y;
+		y = t;
+	}
+	mag_sub(d, x->digits, x->ndigits, y->digits, y->ndigits);
+	return big_result(ip, d, x->ndigits, x->negative);
+}
+
+static value num_mul(interp * ip, value a, value b)
+{
+	long long int r;
+	if (is_int(a) && is_int(b)
+	    && !__builtin_mul_overflow(get_int(a), get_int(b), &r))
+		return make_int(ip, r);
+
+	bigview x, y;
+	big_view(a, &x);
+	big_view(b, &y);
+	if (x.ndigits == 0 || y.ndigits == 0)
+		return make_fixnum(0);
+	digit *d = malloc((x.ndigits + y.ndigits) * sizeof(digit));
+	mag_mul(d, x.digits, x.ndigits, y.digits, y.ndigits);
+	return big_result(ip, d, x.ndigits + y.ndigits,
+			  x.negative != y.negative);
+}
+
+/* Returns a negative number, 0 or a positive number like strcmp. */
+static int num_cmp(value a, value b)
+{
+	if (is_int(a) && is_int(b)) {
+		long long int x = get_int(a), y = get_int(b);
+		return (x > y) - (x < y);
+	}
+
+	bigview x, y;
+	big_view(a, &x);
+	big_view(b, &y);
+	if (x.negative != y.negative)
+		return x.negative ? -1 : 1;
+	int c = mag_cmp(x.digits, x.ndigits, y.digits, y.ndigits);
+	return x.negative ? -c : c;
+}
+
+/*
+ * m = m * factor + addend; m has n digits and room for one more.
+ * Returns:
+ *   the new length of m.
+ */
+static size_t mag_mul_add(digit * m, size_t n, digit factor, digit addend)
+{
+	uint64_t carry = addend;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		carry += (uint64_t) m[i] * factor;
+		m[i] = (digit) carry;
+		carry >>= 32;
+	}
+	if (carry != 0)
+		m[n++] = (digit) carry;
+	return n;
+}
+
+/* Print a bignum in decimal, in chunks of nine digits. */
+void out_big(expr * e)
+{
+	size_t n = e->ndigits, nchunks = 0, i;
+	digit *t = malloc(n * sizeof(digit));
+	uint32_t *chunks = malloc((n * 10 / 9 + 2) * sizeof(uint32_t));
+
+	memcpy(t, e->digits, n * sizeof(digit));
+	while (n > 0) {
+		uint64_t rem = 0;
+		for (i = n; i-- > 0;) {
+			uint64_t cur = rem << 32 | t[i];
+			t[i] = (digit) (cur / 1000000000);
+			rem = cur % 1000000000;
+		}
+		chunks[nchunks++] = (uint32_t) rem;
+		n = mag_len(t, n);
+	}
+	if (e->negative)
+		out_char('-');
+	out_int(chunks[nchunks - 1]);
+	for (i = nchunks - 1; i-- > 0;)
+		out_printf("%09u", chunks[i]);
+	free(t);
+	free(chunks);
+}
+
+/*
+ * Add a new binding to an environment frame. The symbol must not be
+ * bound in this frame yet. value may be NULL for an unbound slot.
+ */
+static dictentry *env_insert(interp * ip, env * env, symbol * sym, value value)
+{
+	env_lock(ip);
+	if (env->hashed ? (env->count + 1) * 2 > env->capacity
+	    : env->count == env->capacity)
+		env_grow(ip, env);
+
+	dictentry *d = pool_alloc(ip, &ip->dict_pool);
+	d->sym = sym;
+	d->value = value;
+	if (env->hashed)
+		env_hash_insert(env->entries, env->capacity, d);
+	else
+		env->entries[env->count] = d;
+	env->count++;
+	gc_write_barrier(ip, env, d);
+	env_unlock(ip);
+
+	return d;
+}
+
+/*
+ * Add a key-value pair to an environment.
+ * Params:
+ *   env : An environment struct pointer. Must be non-NULL.
+ *   sym : New key to be inserted. Must be non-NULL.
+ *   value : Value to be inserted/updated. Must be non-NULL.
+ *   set : true if value should be set globally.
+ * Returns:
+ *   The updated dict entry or NULL if there was an error.
+ */
+dictentry *add_to_env(interp * ip, env * env, symbol * sym, value value,
+		      bool set)
+{
+	if (env == NULL || sym == NULL || value == NULL)
+		return NULL;
+
+	dictentry *d;
+
+	/* set! updates the innermost existing binding. */
+	if (set) {
+		for (; env != NULL; env = env->outer) {
+			if ((d = env_lookup(ip, env, sym)) != NULL
+			    && d->value != NULL) {
+				d->value = value;
+				gc_write_barrier(ip, d, value);
+				return d;
+			}
+		}
+		print_err("Variable '%s' not defined.\n", sym->name);
+		return NULL;
+	}
+
+	env_lock(ip);
+	if ((d = env_lookup(ip, env, sym)) != NULL) {
+		if (d->value == NULL)
+			ip->global_version++;
+		d->value = value;
+		gc_write_barrier(ip, d, value);
+	} else {
+		ip->global_version++;
+		d = env_insert(ip, env, sym, value);
+	}
+	env_unlock(ip);
+	return d;
+}
+
+/*
+ * Create the environment frame for a lambda application. Every slot of
+ * the lambda gets its own dict entry, so that slot i of the frame is
+ * always entries[i]. Slots for variables defined in the body start out
+ * unbound.
+ * Params:
+ *   outer : the environment the lambda was created in.
+ *   info : the frame layout of the lambda.
+ *   argv : the argument values.
+ */
+static env *create_lambda_env(interp * ip, env * outer, lambdainfo * info,
+			      value * argv)
+{
+	env *new = create_env(ip, outer, 0);
+	int i;
+
+	new->entries = malloc(info->nslots * sizeof(dictentry *));
+	new->capacity = new->count = info->nslots;
+	for (i = 0; i < info->nslots; i++) {
+		dictentry *d = pool_alloc(ip, &ip->dict_pool);
+		d->sym = info->slots[i];
+		d->value = NULL;
+		if (i < info->argc)
+			d->value = argv[i];
+		new->entries[i] = d;
+	}
+	return new;
+}
+
+/* A lexical scope used by the analysis; mirrors a lambda frame. */
+typedef struct scope {
+	lambdainfo *info;
+	int capacity;
+	int free_capacity;
+	struct scope *outer;
+} scope;
+
+static void scope_add(scope * sc, symbol * s)
+{
+	int i;
+	for (i = 0; i < sc->info->nslots; i++) {
+		if (sc->info->slots[i] == s)
+			return;
+	}
+	if (sc->info->nslots == sc->capacity) {
+		sc->capacity = sc->capacity == 0 ? 4 : sc->capacity * 2;
+		sc->info->slots =
+		    realloc(sc->info->slots, sc->capacity * sizeof(symbol *));
+	}
+	sc->info->slots[sc->info->nslots++] = s;
+}
+
+static bool scope_resolve(scope *, symbol *, int *, int *);
+
+/*
+ * Find or add a free variable of a lambda.
+ * Returns:
+ *   true with its index in *slot, or false if s is a global variable.
+ */
+static bool scope_capture(scope * sc, symbol * s, int *slot)
+{
+	lambdainfo *info = sc->info;
+	int i, depth, from;
+	for (i = 0; i < info->nfree; i++) {
+		if (info->free[i].sym == s) {
+			*slot = i;
+			return true;
+		}
+	}
+	if (!scope_resolve(sc->outer, s, &depth, &from))
+		return false;
+
+	if (info->nfree == sc->free_capacity) {
+		sc->free_capacity =
+		    sc->free_capacity == 0 ? 4 : sc->free_capacity * 2;
+		info->free =
+		    realloc(info->free, sc->free_capacity * sizeof(freevar));
+	}
+	info->free[info->nfree].sym = s;
+	info->free[info->nfree].depth = depth;
+	info->free[info->nfree].slot = from;
+	*slot = info->nfree++;
+	return true;
+}
+
+/*
+ * Resolve a variable reference in a scope. A variable of an enclosing
+ * lambda becomes a free variable of every lambda in between.
+ * Returns:
+ *   true for a variable of a lambda: slot *slot of the frame if *depth
+ *   is 0, or of the closure record if *depth is 1. false for a global
+ *   variable.
+ */
+static bool scope_resolve(scope * sc, symbol * s, int *depth, int *slot)
+{
+	int i, outer;
+	if (sc == NULL)
+		return false;
+	for (i = 0; i < sc->info->nslots; i++) {
+		if (sc->info->slots[i] != s)
+			continue;
+		/*
+		 * A defined variable may be used before its definition;
+		 * then the binding of an enclosing lambda is used, so that
+		 * binding is captured as well.
+		 */
+		if (i >= sc->info->argc)
+			scope_capture(sc, s, &outer);
+		*depth = 0;
+		*slot = i;
+		return true;
+	}
+	if (!scope_capture(sc, s, slot))
+		return false;
+	*depth = 1;
+	return true;
+}
+
+/*
+ * Reserve a slot for every variable which is defined in a lambda body.
+ * Quoted data and nested lambdas are skipped.
+ */
+static void collect_defines(interp * ip, value e, scope * sc)
+{
+	if (!is_pair(e))
+		return;
+
+	symbol *head = get_symbol(car(e));
+	if (head == ip->sym_quote || head == ip->sym_lambda)
+		return;
+	if (head == ip->sym_define && is_pair(cdr(e))
+	    && get_symbol(car(cdr(e))) != NULL)
+		scope_add(sc, get_symbol(car(cdr(e))));
+	for (; is_pair(e); e = cdr(e))
+		collect_defines(ip, car(e), sc);
+}
+
+node *analyze(interp * ip, value, scope *);
+
+static node *create_node(interp * ip, enum nodetype type,
+			 value(*eval) (interp *, node **, env **))
+{
+	node *new = pool_alloc(ip, &ip->node_pool);
+	memset(new, 0, sizeof(node));
+	new->type = type;
+	new->eval = eval;
+
+	return new;
+}
+
+value eval_node(interp * ip, node *, env *);
+static value future_spawn(interp * ip, node *, env *);
+static value future_touch(interp * ip, value);
+static void pcall_touch(interp * ip, node *, size_t);
+
+static value eval_const(interp * ip, node ** np, env ** enp)
+{
+	return (*np)->constant;
+}
+
+static value eval_local(interp * ip, node ** np, env ** enp)
+{
+	env *frame = *enp;
+	int depth;
+	for (depth = (*np)->depth; depth > 0; depth--)
+		frame = frame->outer;
+	dictentry *d = frame->entries[(*np)->slot];
+	value res = d->value;
+	/* Not defined yet: fall back to the enclosing frames. */
+	if (res == NULL
+	    && (res = find_cached(ip, &(*np)->cache, d->sym,
+				  frame->outer)) == NULL) {
+		print_err("Variable not defined here: %s.\n", d->sym->name);
+		exit(-1);
+	}
+	return res;
+}
+
+static value eval_global(interp * ip, node ** np, env ** enp)
+{
+	dictentry *cell = (*np)->cell;
+	if (cell->value == NULL) {
+		print_err("Variable not defined here: %s.\n", cell->sym->name);
+		exit(-1);
+	}
+	return cell->value;
+}
+
+/*
+ * Create a closure of a lambda node in an environment. Closures are
+ * flat: the environment of a closure is a record of just the bindings
+ * of its free variables, whose outer frame is the global environment.
+ * The record shares the dict entries with the frames they come from, so
+ * they work as boxes for `define' and `set!'. A closure without free
+ * variables uses the global environment itself. Either way, a closure
+ * does not keep the frames of its creator alive.
+ */
+static value make_closure(interp * ip, node * n, env * en)
+{
+	lambdainfo *info = n->info;
+	env *record = ip->global_env;
+	int i;
+
+	if (info->nfree > 0) {
+		record = create_env(ip, ip->global_env, 0);
+		record->entries = malloc(info->nfree * sizeof(dictentry *));
+		record->capacity = record->count = info->nfree;
+		for (i = 0; i < info->nfree; i++) {
+			env *from = info->free[i].depth == 0 ? en : en->outer;
+			record->entries[i] = from->entries[info->free[i].slot];
+		}
+	}
+
+	expr *closure = create_expr(ip, EXPRLAMBDA);
+	closure->lambdavars = n->lambdavars;
+	closure->lambdaexpr = n->lambdaexpr;
+	closure->lambdaenv = record;
+	closure->lambdainfo = info;
+	return (value) closure;
+}
+
+static value eval_lambda(interp * ip, node ** np, env ** enp)
+{
+	return make_closure(ip, *np, *enp);
+}
+
+static value eval_define(interp * ip, node ** np, env ** enp)
+{
+	value val = eval_node(ip, (*np)->valuenode, *enp);
+	symbol *target = (*np)->target;
+	if (add_to_env(ip, *enp, target, val, (*np)->type == NODESET) == NULL) {
+		print_err("Could not define/set %s.\n", target->name);
+		exit(-1);
+	}
+	debug_info("Defined value %s.\n", target->name);
+	return VAL_EMPTY;
+}
+
+static value eval_if(interp * ip, node ** np, env ** enp)
+{
+	value cond = eval_node(ip, (*np)->test, *enp);
+	if (is_number(cond) || cond == VAL_TRUE)
+		*np = (*np)->then;
+	else if (cond == VAL_FALSE)
+		*np = (*np)->otherwise;
+	else {
+		print_err("%s",
+			  "Illegal if condition. Must be boolean or number\n");
+		exit(-1);
+	}
+	return NULL;
+}
+
+/* Evaluate a sequence of nodes; the last one is a tail. */
+static value eval_begin(interp * ip, node ** np, env ** enp)
+{
+	for (*np = (*np)->body; (*np)->next != NULL; *np = (*np)->next)
+		eval_node(ip, *np, *enp);
+	return NULL;
+}
+
+static value eval_future(interp * ip, node ** np, env ** enp)
+{
+	return future_spawn(ip, *np, *enp);
+}
+
+static inline bool is_proc(expr * fn)
+{
+	return fn != NULL && (fn->type == EXPRPROC || fn->type == EXPRNATIVE);
+}
+
+/*
+ * Call a builtin or a native procedure. The arguments are passed where
+ * they are, i.e. on the value stack.
+ */
+static inline value call_proc(interp * ip, expr * fn, int argc,
+			      value * argv)
+{
+	self->counters.proc_calls++;
+	if (fn->type == EXPRPROC)
+		return fn->proc(ip, argc, argv);
+	if (fn->arity != MINICLISP_VARIADIC && fn->arity != argc) {
+		print_err("Wrong number of arguments for a native procedure"
+			  " %d required: %d\n", fn->arity, argc);
+		exit(-1);
+	}
+	return fn->native(ip, fn->data, argc, argv);
+}
+
+/*
+ * Evaluate a procedure call. The operator and the arguments are
+ * evaluated onto the value stack, which keeps them alive until the
+ * call. The arguments of a pcall are touched before the call. A lambda
+ * body is a tail: its frame replaces the environment of the caller.
+ */
+static value eval_call(interp * ip, node ** np, env ** enp)
+{
+	size_t base = self->vstack_top;
+	size_t roots = gc_roots_save();
+	node *arg = (*np)->args;
+
+	gc_root_node(&arg);
+	for (; arg != NULL; arg = arg->next)
+		vstack_push(eval_node(ip, arg, *enp));
+	gc_roots_restore(roots);
+	if ((*np)->type == NODEPCALL)
+		pcall_touch(ip, (*np)->args, base);
+
+	expr *fn = value_expr(self->vstack[base]);
+	int argc = self->vstack_top - base - 1;
+	value *argv = self->vstack + base + 1;
+
+	if (is_proc(fn)) {
+		debug_info("%s", "Call proc!\n");
+		value res = call_proc(ip, fn, argc, argv);
+		self->vstack_top = base;
+		return res;
+	}
+	if (fn == NULL || fn->type != EXPRLAMBDA) {
+		print_err("%s", "Could not call a non-procedure\n");
+		exit(-1);
+	}
+	lambdainfo *info = fn->lambdainfo;
+	if (info->argc != argc) {
+		print_err
+		    ("Wrong number of arguments for lambda %d required: %d\n",
+		     info->argc, argc);
+		exit(-1);
+	}
+	debug_info("%s", "Evaluate Lambda Expr\n");
+	print_value_debug(fn->lambdaexpr);
+	self->counters.applications++;
+	if (profiling)
+		prof_enter(info->name, prof_depth > prof_base);
+	*enp = create_lambda_env(ip, fn->lambdaenv, info, argv);
+	*np = info->body;
+	self->vstack_top = base;
+	return NULL;
+}
+
+/*
+ * Evaluate an analyzed expression in an environment. This is the
+ * tree-walking evaluator: it calls the handler of the node until the
+ * handler returns a value instead of a tail, so tail calls run in
+ * constant C stack and the frame of the caller can be collected.
+ */
+value eval_node(interp * ip, node * n, env * en)
+{
+	size_t roots = gc_roots_save();
+	value res;
+
+	size_t prof_saved = prof_base;
+	if (profiling)
+		prof_base = prof_depth;
+
+	gc_root_node(&n);
+	gc_root_env(&en);
+	do {
+		gc_safepoint(ip);
+		self->counters.evals[n->type]++;
+		res = n->eval(ip, &n, &en);
+	} while (res == NULL);
+
+	if (profiling) {
+		prof_depth = prof_base;
+		prof_base = prof_saved;
+	}
+
+	gc_roots_restore(roots);
+	return res;
+}
+
+static node *analyze_lambda(interp * ip, value e, scope * outer);
+static node *analyze_pcall(interp * ip, value l, scope * sc);
+
+/*
+ * Analyze a list of expressions. A sequence of several expressions
+ * becomes a NODEBEGIN.
+ */
+static node *analyze_sequence(interp * ip, value l, scope * sc)
+{
+	if (!is_pair(l)) {
+		node *n = create_node(ip, NODECONST, eval_const);
+		n->constant = VAL_EMPTY;
+		return n;
+	}
+	node *first = analyze(ip, car(l), sc);
+	if (!is_pair(cdr(l)))
+		return first;
+
+	node *n = create_node(ip, NODEBEGIN, eval_begin);
+	node *last = n->body = first;
+	for (l = cdr(l); is_pair(l); l = cdr(l))
+		last = last->next = analyze(ip, car(l), sc);
+	return n;
+}
+
+/*
+ * The analysis. Turn an expression as returned by read() into a tree
+ * of nodes. Variable references are resolved to the slots of the
+ * lambda frame, to the closure record (see make_closure) or to global
+ * cells; globals which are not defined yet get an unbound binding cell,
+ * which `define' fills in later. The expression itself is not modified.
+ * Params:
+ *   e : the expression.
+ *   sc : the scope of the enclosing lambda or NULL at the top level.
+ */
+node *analyze(interp * ip, value e, scope * sc)
+{
+	node *n;
+	symbol *sym = get_symbol(e);
+	int depth, slot;
+
+	if (sym != NULL) {
+		if (scope_resolve(sc, sym, &depth, &slot)) {
+			n = create_node(ip, NODELOCAL, eval_local);
+			n->depth = depth;
+			n->slot = slot;
+			return n;
+		}
+		dictentry *cell = env_lookup(ip, ip->global_env, sym);
+		if (cell == NULL)
+			cell = env_insert(ip, ip->global_env, sym, NULL);
+		n = create_node(ip, NODEGLOBAL, eval_global);
+		n->cell = cell;
+		return n;
+	}
+	if (!is_pair(e)) {
+		/* Boxed integers are shared with the expression. */
+		n = create_node(ip, NODECONST, eval_const);
+		n->constant = e;
+		return n;
+	}
+
+	value args = cdr(e);
+	symbol *head = get_symbol(car(e));
+	int size = get_list_size(e);
+	if (size < 0) {
+		print_err("%s", "Cannot evaluate an improper list.\n");
+		exit(-1);
+	}
+	if (head == ip->sym_define || head == ip->sym_set) {
+		if (size != 3) {
+			print_err
+			    ("Wrong number of arguments for 'define'/'set!': %d\n",
+			     size);
+			exit(-1);
+		}
+		if (get_symbol(car(args)) == NULL) {
+			print_err
+			    ("%s",
+			     "Argument 1 for 'define'/'set!' is not a symbol.\n");
+			exit(-1);
+		}
+		n = create_node(ip, head == ip->sym_set ? NODESET : NODEDEFINE,
+				eval_define);
+		n->target = get_symbol(car(args));
+		/* set! finds its binding at run time; make sure it is there. */
+		if (head == ip->sym_set)
+			scope_resolve(sc, n->target, &depth, &slot);
+		n->valuenode = analyze(ip, get_next(args, 1), sc);
+		/* Name the lambda after its variable for the profiler. */
+		if (n->valuenode->type == NODELAMBDA
+		    && n->valuenode->info->name == NULL)
+			n->valuenode->info->name = n->target;
+		return n;
+	}
+	if (head == ip->sym_quote) {
+		if (size != 2) {
+			print_err
+			    ("%s", "Wrong number of arguments for 'quote'.\n");
+			exit(-1);
+		}
+		/* The quoted list is shared, not copied. */
+		n = create_node(ip, NODECONST, eval_const);
+		n->constant = car(args);
+		return n;
+	}
+	if (head == ip->sym_if) {
+		if (size != 4) {
+			print_err
+			    ("%s", "Wrong number of arguments for 'if'.\n");
+			exit(-1);
+		}
+		n = create_node(ip, NODEIF, eval_if);
+		n->test = analyze(ip, get_next(args, 0), sc);
+		n->then = analyze(ip, get_next(args, 1), sc);
+		n->otherwise = analyze(ip, get_next(args, 2), sc);
+		return n;
+	}
+	if (head == ip->sym_begin)
+		return analyze_sequence(ip, args, sc);
+	if (head == ip->sym_lambda)
+		return analyze_lambda(ip, e, sc);
+	if (head == ip->sym_future) {
+		if (size != 2) {
+			print_err
+			    ("%s", "Wrong number of arguments for 'future'.\n");
+			exit(-1);
+		}
+		n = create_node(ip, NODEFUTURE, eval_future);
+		n->task = analyze(ip, car(args), sc);
+		return n;
+	}
+	if (head == ip->sym_pcall) {
+		if (size < 2) {
+			print_err
+			    ("%s", "Wrong number of arguments for 'pcall'.\n");
+			exit(-1);
+		}
+		return analyze_pcall(ip, args, sc);
+	}
+
+	n = create_node(ip, NODECALL, eval_call);
+	n->argc = size - 1;
+	node *last = n->args = analyze(ip, car(e), sc);
+	for (; is_pair(args); args = cdr(args))
+		last = last->next = analyze(ip, car(args), sc);
+	return n;
+}
+
+/*
+ * Whether a node is too cheap to be evaluated as a task of its own.
+ */
+static bool node_trivial(node * n)
+{
+	return n->type == NODECONST || n->type == NODELOCAL
+	    || n->type == NODEGLOBAL || n->type == NODELAMBDA;
+}
+
+/*
+ * Analyze (pcall proc args ...), a call whose arguments are evaluated
+ * in parallel: every argument becomes an implicit future, except for
+ * trivial ones and the last one which is not trivial. That one is
+ * evaluated by the calling thread while the others run.
+ * Params:
+ *   l : the operator followed by the arguments.
+ */
+static node *analyze_pcall(interp * ip, value l, scope * sc)
+{
+	node *n = create_node(ip, NODEPCALL, eval_call);
+	node *arg, *last = NULL;
+
+	n->argc = get_list_size(l) - 1;
+	arg = n->args = analyze(ip, car(l), sc);
+	for (l = cdr(l); is_pair(l); l = cdr(l))
+		arg = arg->next = analyze(ip, car(l), sc);
+
+	for (arg = n->args->next; arg != NULL; arg = arg->next) {
+		if (!node_trivial(arg))
+			last = arg;
+	}
+	for (arg = n->args; arg->next != NULL; arg = arg->next) {
+		node *task = arg->next;
+		if (task == last || node_trivial(task))
+			continue;
+		node *f = create_node(ip, NODEFUTURE, eval_future);
+		f->task = task;
+		f->implicit = true;
+		f->next = task->next;
+		task->next = NULL;
+		arg->next = f;
+	}
+	return n;
+}
+
+/*
+ * Analyze a lambda form: compute its frame layout and analyze its body
+ * once. Evaluating the resulting node creates a closure.
+ * Params:
+ *   e : a list of the form (lambda (args ...) body ...).
+ *   outer : the scope of the enclosing lambda or NULL.
+ */
+static node *analyze_lambda(interp * ip, value e, scope * outer)
+{
+	value args = get_next(e, 1);
+	if (args == NULL || (!is_pair(args) && args != VAL_EMPTY)) {
+		print_err("%s", "First Lambda Parameter must be a list\n");
+		exit(-1);
+	}
+
+	scope sc;
+	sc.info = malloc(sizeof(lambdainfo));
+	sc.info->nslots = 0;
+	sc.info->slots = NULL;
+	sc.info->nfree = 0;
+	sc.info->free = NULL;
+	sc.info->code = NULL;
+	sc.info->name = NULL;
+	sc.capacity = 0;
+	sc.free_capacity = 0;
+	sc.outer = outer;
+
+	value arg;
+	for (arg = args; is_pair(arg); arg = cdr(arg)) {
+		if (get_symbol(car(arg)) == NULL) {
+			print_err("%s", "Wrong parameter list for lambda\n");
+			exit(-1);
+		}
+		scope_add(&sc, get_symbol(car(arg)));
+	}
+	sc.info->argc = sc.info->nslots;
+
+	value body = cdr(cdr(e));
+	for (arg = body; is_pair(arg); arg = cdr(arg))
+		collect_defines(ip, car(arg), &sc);
+	sc.info->body = analyze_sequence(ip, body, &sc);
+	gc_add_lambda(ip, sc.info);
+
+	node *n = create_node(ip, NODELAMBDA, eval_lambda);
+	n->info = sc.info;
+	n->lambdavars = args;
+	n->lambdaexpr = body;
+	return n;
+}
+
+/**        BYTECODE COMPILER AND VIRTUAL MACHINE: **/
+
+/*
+ * The instructions of the virtual machine. Operands follow the opcode
+ * in the instruction stream:
+ *   OP_CONST k          push consts[k].
+ *   OP_LOCAL d s c      push slot s of the frame (d = 0) or of the
+ *                       closure record (d = 1); c is the inline
+ *                       cache (three words) used if the slot is not
+ *                       bound yet.
+ *   OP_GLOBAL k         push the value of the global cell consts[k].
+ *   OP_DEFINE sym       bind sym to the top of the stack in the current
+ *                       frame and replace it by '().
+ *   OP_SET sym          the same for set!.
+ *   OP_POP              drop the top of the stack.
+ *   OP_JUMP t           continue at ops[t].
+ *   OP_JUMPF t          pop a condition and jump to ops[t] if it is #f.
+ *   OP_CLOSURE k        push a closure of the lambda node consts[k].
+ *   OP_CALL n           call the procedure below the n arguments on the
+ *                       top of the stack.
+ *   OP_TAILCALL n       the same, but the callee replaces the frame.
+ *   OP_RETURN           return the top of the stack to the caller.
+ *   OP_FUTURE k         push a future of the future node consts[k].
+ *   OP_TOUCH d          replace the value d entries below the top of
+ *                       the stack by its value if it is a future.
+ */
+enum opcode { OP_CONST, OP_LOCAL, OP_GLOBAL, OP_DEFINE, OP_SET,
+	OP_POP, OP_JUMP, OP_JUMPF, OP_CLOSURE, OP_CALL, OP_TAILCALL,
+	OP_RETURN, OP_FUTURE, OP_TOUCH
+};
+
+/* The state of the compiler while it emits one code object. */
+typedef struct compiler {
+	code *c;
+	int depth;
+} compiler;
+
+static void emit(compiler * cp, intptr_t word)
+{
+	code *c = cp->c;
+	if (c->len == c->capacity) {
+		c->capacity = c->capacity == 0 ? 32 : c->capacity * 2;
+		c->ops = realloc(c->ops, c->capacity * sizeof(intptr_t));
+	}
+	c->ops[c->len++] = word;
+}
+
+/* Account for the stack effect of the last instruction. */
+static void stack_effect(compiler * cp, int n)
+{
+	cp->depth += n;
+	if (cp->depth > cp->c->maxstack)
+		cp->c->maxstack = cp->depth;
+}
+
+static void emit_const(compiler * cp, value v)
+{
+	code *c = cp->c;
+	if (c->nconsts == c->consts_capacity) {
+		c->consts_capacity =
+		    c->consts_capacity == 0 ? 8 : c->consts_capacity * 2;
+		c->consts = realloc(c->consts, c->consts_capacity
+				    * sizeof(value));
+	}
+	c->consts[c->nconsts] = v;
+	emit(cp, c->nconsts++);
+}
+
+/*
+ * Compile an analyzed expression. The code leaves the value of n on the
+ * stack.
+ * Params:
+ *   tail : true if n is in tail position, i.e. its value is returned.
+ */
+static code *compile(interp * ip, node *);
+
+static void compile_node(interp * ip, compiler * cp, node * n, bool tail)
+{
+	size_t jumpf, jump;
+	node *arg;
+	int i;
+
+	switch (n->type) {
+	case NODECONST:
+		emit(cp, OP_CONST);
+		emit_const(cp, n->constant);
+		stack_effect(cp, 1);
+		break;
+	case NODELOCAL:
+		emit(cp, OP_LOCAL);
+		emit(cp, n->depth);
+		emit(cp, n->slot);
+		emit(cp, 0);
+		emit(cp, 0);
+		emit(cp, 0);
+		stack_effect(cp, 1);
+		break;
+	case NODEGLOBAL:
+		emit(cp, OP_GLOBAL);
+		emit_const(cp, (value) n->cell);
+		stack_effect(cp, 1);
+		break;
+	case NODELAMBDA:
+		emit(cp, OP_CLOSURE);
+		emit_const(cp, (value) n);
+		stack_effect(cp, 1);
+		break;
+	case NODEDEFINE:
+	case NODESET:
+		compile_node(ip, cp, n->valuenode, false);
+		emit(cp, n->type == NODESET ? OP_SET : OP_DEFINE);
+		emit(cp, (intptr_t) n->target);
+		break;
+	case NODEIF:
+		compile_node(ip, cp, n->test, false);
+		emit(cp, OP_JUMPF);
+		emit(cp, 0);
+		stack_effect(cp, -1);
+		jumpf = cp->c->len - 1;
+		compile_node(ip, cp, n->then, tail);
+		emit(cp, OP_JUMP);
+		emit(cp, 0);
+		jump = cp->c->len - 1;
+		cp->c->ops[jumpf] = cp->c->len;
+		stack_effect(cp, -1);
+		compile_node(ip, cp, n->otherwise, tail);
+		cp->c->ops[jump] = cp->c->len;
+		break;
+	case NODEBEGIN:
+		for (n = n->body; n->next != NULL; n = n->next) {
+			compile_node(ip, cp, n, false);
+			emit(cp, OP_POP);
+			stack_effect(cp, -1);
+		}
+		compile_node(ip, cp, n, tail);
+		break;
+	case NODEFUTURE:
+		/* The task gets code of its own, which any thread can run. */
+		if (n->taskcode == NULL)
+			n->taskcode = compile(ip, n->task);
+		emit(cp, OP_FUTURE);
+		emit_const(cp, (value) n);
+		stack_effect(cp, 1);
+		break;
+	case NODECALL:
+	case NODEPCALL:
+		for (arg = n->args; arg != NULL; arg = arg->next)
+			compile_node(ip, cp, arg, false);
+		for (arg = n->args->next, i = 0; arg != NULL;
+		     arg = arg->next, i++) {
+			if (arg->type == NODEFUTURE && arg->implicit) {
+				emit(cp, OP_TOUCH);
+				emit(cp, n->argc - i);
+			}
+		}
+		emit(cp, tail ? OP_TAILCALL : OP_CALL);
+		emit(cp, n->argc);
+		stack_effect(cp, -n->argc);
+		break;
+	}
+}
+
+/*
+ * Compile an analyzed expression into a new code object, which n owns,
+ * and register it with the collector.
+ */
+static code *compile(interp * ip, node * n)
+{
+	compiler cp;
+	cp.c = calloc(1, sizeof(code));
+	cp.c->owner = n;
+	cp.depth = 0;
+	compile_node(ip, &cp, n, true);
+	emit(&cp, OP_RETURN);
+
+	heap_lock(ip);
+	gc_push((void ***)&ip->codes, &ip->ncodes, &ip->codes_capacity, cp.c);
+	heap_unlock(ip);
+	return cp.c;
+}
+
+static void code_free(interp * ip, code * c)
+{
+	size_t i;
+	heap_lock(ip);
+	for (i = ip->ncodes; i-- > 0;) {
+		if (ip->codes[i] == c) {
+			ip->codes[i] = ip->codes[--ip->ncodes];
+			break;
+		}
+	}
+	heap_unlock(ip);
+	free(c->ops);
+	free(c->consts);
+	free(c);
+}
+
+/*
+ * Returns the code of a lambda; it is compiled by the first call. If
+ * several threads compile it at once, one code object wins.
+ */
+static inline code *lambda_code(interp * ip, lambdainfo * info)
+{
+	code *c = __atomic_load_n(&info->code, __ATOMIC_ACQUIRE);
+	code *none = NULL;
+	if (c != NULL)
+		return c;
+	c = compile(ip, info->body);
+	if (!__atomic_compare_exchange_n(&info->code, &none, c, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		code_free(ip, c);
+		c = none;
+	}
+	return c;
+}
+
+/* A call frame of the virtual machine. */
+typedef struct vmframe {
+	code *code;
+	intptr_t *pc;
+	size_t fp;
+} vmframe;
+
+static __thread vmframe *vm_frames;
+static __thread size_t vm_nframes;
+static __thread size_t vm_frames_capacity;
+
+/* Release the frame stack of the current thread before it ends. */
+static void vm_thread_free()
+{
+	free(vm_frames);
+	vm_frames = NULL;
+	vm_frames_capacity = 0;
+}
+
+/*
+ * Run a code object in an environment. Every frame keeps its
+ * environment in the value stack at index fp and the owner of its code
+ * at fp + 1, which keeps the code alive, followed by its operands. A
+ * call replaces the procedure and its arguments by the new frame, so
+ * its result ends up where the procedure was.
+ * Returns:
+ *   the value of the code.
+ */
+value vm_run(interp * ip, code * c, env * en)
+{
+	static void *labels[] = {
+		[OP_CONST] = &&op_const,[OP_LOCAL] = &&op_local,
+		[OP_GLOBAL] = &&op_global,
+		[OP_DEFINE] = &&op_define,[OP_SET] = &&op_set,
+		[OP_POP] = &&op_pop,[OP_JUMP] = &&op_jump,
+		[OP_JUMPF] = &&op_jumpf,[OP_CLOSURE] = &&op_closure,
+		[OP_CALL] = &&op_call,[OP_TAILCALL] = &&op_call,
+		[OP_RETURN] = &&op_return,[OP_FUTURE] = &&op_future,
+		[OP_TOUCH] = &&op_touch
+	};
+	size_t base = vm_nframes;
+	size_t prof_saved = prof_depth;
+	intptr_t *pc = c->ops;
+	size_t fp = self->vstack_top;
+	value *sp;
+	value v;
+	env *frame;
+	dictentry *d;
+	intptr_t i;
+	size_t top;
+
+	vstack_reserve(c->maxstack + 2);
+	self->vstack[fp] = (value) en;
+	self->vstack[fp + 1] = (value) c->owner;
+	sp = self->vstack + fp + 2;
+
+#define NEXT() goto *labels[*pc++]
+#define FRAME_ENV() ((env *) self->vstack[fp])
+	NEXT();
+
+ op_const:
+	self->counters.evals[NODECONST]++;
+	*sp++ = c->consts[*pc++];
+	NEXT();
+ op_local:
+	self->counters.evals[NODELOCAL]++;
+	frame = FRAME_ENV();
+	for (i = *pc++; i > 0; i--)
+		frame = frame->outer;
+	d = frame->entries[*pc++];
+	v = d->value;
+	/* Not defined yet: fall back to the enclosing frames. */
+	if (v == NULL && (v = find_cached(ip, (lookupcache *) pc, d->sym,
+					  frame->outer)) == NULL) {
+		print_err("Variable not defined here: %s.\n", d->sym->name);
+		exit(-1);
+	}
+	pc += sizeof(lookupcache) / sizeof(intptr_t);
+	*sp++ = v;
+	NEXT();
+ op_global:
+	self->counters.evals[NODEGLOBAL]++;
+	d = (dictentry *) c->consts[*pc++];
+	if (d->value == NULL) {
+		print_err("Variable not defined here: %s.\n", d->sym->name);
+		exit(-1);
+	}
+	*sp++ = d->value;
+	NEXT();
+ op_define:
+ op_set:
+	self->counters.evals[pc[-1] == OP_SET ? NODESET : NODEDEFINE]++;
+	if (add_to_env(ip, FRAME_ENV(), (symbol *) pc[0], sp[-1],
+		       pc[-1] == OP_SET) == NULL) {
+		print_err("Could not define/set %s.\n",
+			  ((symbol *) pc[0])->name);
+		exit(-1);
+	}
+	pc++;
+	sp[-1] = VAL_EMPTY;
+	NEXT();
+ op_pop:
+	sp--;
+	NEXT();
+ op_jump:
+	pc = c->ops + *pc;
+	NEXT();
+ op_jumpf:
+	self->counters.evals[NODEIF]++;
+	v = *--sp;
+	if (v == VAL_FALSE) {
+		pc = c->ops + *pc;
+	} else if (is_number(v) || v == VAL_TRUE) {
+		pc++;
+	} else {
+		print_err("%s",
+			  "Illegal if condition. Must be boolean or number\n");
+		exit(-1);
+	}
+	NEXT();
+ op_closure:
+	self->counters.evals[NODELAMBDA]++;
+	v = make_closure(ip, (node *) c->consts[*pc++], FRAME_ENV());
+	*sp++ = v;
+	NEXT();
+ op_call:{
+		bool tail = pc[-1] == OP_TAILCALL;
+		int argc = *pc++;
+		size_t callee = sp - self->vstack - argc - 1;
+
+		/* The procedure and its arguments are on the value stack. */
+		self->vstack_top = sp - self->vstack;
+		gc_safepoint(ip);
+		self->counters.evals[NODECALL]++;
+
+		expr *fn = value_expr(self->vstack[callee]);
+		value *argv = self->vstack + callee + 1;
+		if (is_proc(fn)) {
+			v = call_proc(ip, fn, argc, argv);
+			sp = self->vstack + callee;
+			*sp++ = v;
+			if (tail)
+				goto op_return;
+			NEXT();
+		}
+		if (fn == NULL || fn->type != EXPRLAMBDA) {
+			print_err("%s", "Could not call a non-procedure\n");
+			exit(-1);
+		}
+		lambdainfo *info = fn->lambdainfo;
+		if (info->argc != argc) {
+			print_err
+			    ("Wrong number of arguments for lambda %d required: %d\n",
+			     info->argc, argc);
+			exit(-1);
+		}
+		self->counters.applications++;
+		if (profiling)
+			prof_enter(info->name, tail && prof_depth > prof_saved);
+		frame = create_lambda_env(ip, fn->lambdaenv, info, argv);
+
+		if (!tail) {
+			if (vm_nframes == vm_frames_capacity) {
+				vm_frames_capacity = vm_frames_capacity == 0
+				    ? 64 : vm_frames_capacity * 2;
+				vm_frames = realloc(vm_frames,
+						    vm_frames_capacity *
+						    sizeof(vmframe));
+			}
+			vm_frames[vm_nframes].code = c;
+			vm_frames[vm_nframes].pc = pc;
+			vm_frames[vm_nframes].fp = fp;
+			vm_nframes++;
+			fp = callee;
+		}
+		c = lambda_code(ip, info);
+		pc = c->ops;
+		self->vstack_top = fp + 2;
+		vstack_reserve(c->maxstack + 2);
+		self->vstack[fp] = (value) frame;
+		self->vstack[fp + 1] = (value) c->owner;
+		sp = self->vstack + fp + 2;
+		NEXT();
+	}
+ op_return:
+	v = sp[-1];
+	if (vm_nframes == base) {
+		if (profiling)
+			prof_depth = prof_saved;
+		self->vstack_top = fp;
+		return v;
+	}
+	if (profiling)
+		prof_depth--;
+	sp = self->vstack + fp;
+	*sp++ = v;
+	vm_nframes--;
+	c = vm_frames[vm_nframes].code;
+	pc = vm_frames[vm_nframes].pc;
+	fp = vm_frames[vm_nframes].fp;
+	NEXT();
+ op_future:
+	/* The task may run right here, which can move the stack. */
+	self->counters.evals[NODEFUTURE]++;
+	top = sp - self->vstack;
+	self->vstack_top = top;
+	v = future_spawn(ip, (node *) c->consts[*pc++], FRAME_ENV());
+	sp = self->vstack + top;
+	*sp++ = v;
+	NEXT();
+ op_touch:
+	top = sp - self->vstack;
+	self->vstack_top = top;
+	i = *pc++;
+	v = future_touch(ip, sp[-i]);
+	sp = self->vstack + top;
+	sp[-i] = v;
+	NEXT();
+#undef NEXT
+#undef FRAME_ENV
+}
+
+/*
+ * Evaluate a form read at the top level. The form is analyzed once,
+ * including the bodies of its lambdas, and the resulting node tree is
+ * run by the tree-walker or compiled for the virtual machine.
+ * Params:
+ *   e : the form as returned by read().
+ *   en : the global environment.
+ */
+value eval_toplevel(interp * ip, value e, env * en)
+{
+	worker *prev = interp_enter(ip);
+	node *n = analyze(ip, e, NULL);
+	value res;
+
+	if (ip->use_tree_walker) {
+		res = eval_node(ip, n, en);
+	} else {
+		size_t roots = gc_roots_save();
+		gc_root_node(&n);
+		code *c = compile(ip, n);
+		res = vm_run(ip, c, en);
+		code_free(ip, c);
+		gc_roots_restore(roots);
+	}
+	interp_leave(prev);
+	return res;
+}
+
+/**        FUTURES: **/
+
+/*
+ * (future e) starts the evaluation of e in parallel and returns a
+ * future; (touch f) waits for its value. (pcall proc args ...) is a call
+ * whose arguments are evaluated in parallel, see analyze_pcall.
+ *
+ * Futures are run by a pool of worker threads, one of which is the main
+ * thread. Every worker has a deque: it pushes the futures it creates at
+ * the bottom and pops them from there again, while idle workers steal
+ * the oldest, i.e. usually the largest, tasks from the top of the
+ * deques of other workers. A thread which touches a future that is
+ * still queued runs it itself; if another thread is running it, it
+ * helps with the other queued futures in the meantime.
+ *
+ * Tasks which are too small to pay for a thread switch stay
+ * sequential: a future is evaluated on the spot if its expression is
+ * trivial or if the deque of its worker already holds task_grain
+ * futures, which happens as soon as the recursion of a parallel
+ * algorithm is deep enough to keep every worker busy. Then the value
+ * itself is returned instead of a future, and touch returns any value
+ * which is not a future as it is.
+ */
+
+enum { FUTURE_QUEUED, FUTURE_RUNNING, FUTURE_DONE };
+
+/* Push a future on the bottom of the deque of the current thread. */
+static bool deque_push(deque * d, expr * f)
+{
+	long b = d->bottom;
+	if (b - __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >= DEQUE_SIZE)
+		return false;
+	d->tasks[b % DEQUE_SIZE] = f;
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/*
+ * Pop the newest future of the deque of the current thread.
+ * Returns:
+ *   the future or NULL if the deque is empty.
+ */
+static expr *deque_pop(deque * d)
+{
+	long b = d->bottom - 1, t;
+	expr *f = NULL;
+
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if (t <= b) {
+		f = d->tasks[b % DEQUE_SIZE];
+		if (t < b)
+			return f;
+		/* The last future; a thief may take it at the same time. */
+		if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			f = NULL;
+	}
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return f;
+}
+
+/*
+ * Steal the oldest future of the deque of another thread.
+ * Returns:
+ *   the future or NULL if the deque is empty or another thread was
+ *   faster.
+ */
+static expr *deque_steal(deque * d)
+{
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	expr *f = __atomic_load_n(&d->tasks[t % DEQUE_SIZE], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return f;
+}
+
+/*
+ * Take a future to run: the newest one of the current thread, or else
+ * one stolen from another thread.
+ * Returns:
+ *   the future or NULL if none was found.
+ */
+static expr *future_next(interp * ip)
+{
+	expr *f = deque_pop(&self->tasks);
+	int i, n = ip->nworkers, start = rand_r(&self->seed) % n;
+
+	for (i = 0; f == NULL && i < n; i++) {
+		if (ip->workers[(start + i) % n] != self)
+			f = deque_steal(&ip->workers[(start + i) % n]->tasks);
+	}
+	if (f != NULL)
+		__atomic_fetch_sub(&ip->tasks_queued, 1, __ATOMIC_SEQ_CST);
+	return f;
+}
+
+/* Evaluate the task of a future node in an environment. */
+static value future_eval(interp * ip, node * n, env * en)
+{
+	if (ip->use_tree_walker || n->taskcode == NULL)
+		return eval_node(ip, n->task, en);
+	return vm_run(ip, n->taskcode, en);
+}
+
+/*
+ * Run a future on the current thread, unless another thread has claimed
+ * it already.
+ */
+static void future_run(interp * ip, expr * f)
+{
+	int state = FUTURE_QUEUED;
+	if (!__atomic_compare_exchange_n(&f->state, &state, FUTURE_RUNNING,
+					 false, __ATOMIC_ACQUIRE,
+					 __ATOMIC_RELAXED))
+		return;
+
+	size_t roots = gc_roots_save();
+	gc_root_expr(&f);
+	value v = future_eval(ip, f->task, f->taskenv);
+	f->result = v;
+	gc_write_barrier(ip, f, v);
+	__atomic_store_n(&f->state, FUTURE_DONE, __ATOMIC_RELEASE);
+	gc_roots_restore(roots);
+}
+
+/*
+ * The main loop of a worker thread: it runs futures while there are
+ * any and waits for new ones otherwise. While it waits, it is parked
+ * for the collector. It ends when the interpreter is freed.
+ */
+static void *worker_main(void *arg)
+{
+	interp *ip = ((worker *) arg)->ip;
+	expr *f;
+
+	self = arg;
+	pthread_mutex_lock(&ip->heap_mutex);
+	for (;;) {
+		__atomic_fetch_add(&ip->idle_workers, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&ip->tasks_queued, __ATOMIC_SEQ_CST) == 0
+		       && !ip->closing)
+			pthread_cond_wait(&ip->work_cond, &ip->heap_mutex);
+		__atomic_fetch_sub(&ip->idle_workers, 1, __ATOMIC_SEQ_CST);
+		if (ip->closing)
+			break;
+		while (ip->gc_stopping)
+			pthread_cond_wait(&ip->gc_done_cond, &ip->heap_mutex);
+		self->running = true;
+		pthread_mutex_unlock(&ip->heap_mutex);
+
+		while (!__atomic_load_n(&ip->closing, __ATOMIC_RELAXED)
+		       && (f = future_next(ip)) != NULL)
+			future_run(ip, f);
+
+		pthread_mutex_lock(&ip->heap_mutex);
+		self->running = false;
+		pthread_cond_broadcast(&ip->gc_parked_cond);
+	}
+	pthread_mutex_unlock(&ip->heap_mutex);
+	vm_thread_free();
+	return NULL;
+}
+
+/*
+ * Start the worker threads. This happens when the first future is
+ * created, so that programs without futures never take a lock.
+ */
+static void pool_start(interp * ip)
+{
+	int i;
+
+	for (i = 1; i < ip->worker_count; i++) {
+		ip->workers[i] = calloc(1, sizeof(worker));
+		ip->workers[i]->seed = i;
+		ip->workers[i]->ip = ip;
+	}
+	ip->nworkers = ip->worker_count;
+	ip->threaded = true;
+	for (i = 1; i < ip->worker_count; i++) {
+		if (pthread_create(&ip->workers[i]->thread, NULL, worker_main,
+				   ip->workers[i]) != 0) {
+			print_err("%s", "Could not start a worker thread.\n");
+			exit(-1);
+		}
+	}
+}
+
+/*
+ * Create a future for the task of a future node, or evaluate the task
+ * right away if it is not worth a task of its own.
+ * Returns:
+ *   the future or the value of the task.
+ */
+static value future_spawn(interp * ip, node * n, env * en)
+{
+	deque *d = &self->tasks;
+
+	if (!ip->threaded && ip->worker_count > 1)
+		pool_start(ip);
+	if (!ip->threaded || node_trivial(n->task)
+	    || d->bottom - __atomic_load_n(&d->top, __ATOMIC_RELAXED)
+	    >= ip->task_grain)
+		return future_eval(ip, n, en);
+
+	expr *f = create_expr(ip, EXPRFUTURE);
+	f->task = n;
+	f->taskenv = en;
+	if (!deque_push(d, f))
+		return future_eval(ip, n, en);
+	__atomic_fetch_add(&ip->tasks_queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ip->idle_workers, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&ip->heap_mutex);
+		pthread_cond_signal(&ip->work_cond);
+		pthread_mutex_unlock(&ip->heap_mutex);
+	}
+	return (value) f;
+}
+
+/*
+ * Wait for the value of a future. A queued future is run by the current
+ * thread; while another thread runs it, the current thread runs other
+ * futures.
+ * Returns:
+ *   the value of the future, or v itself if it is not a future.
+ */
+static value future_touch(interp * ip, value v)
+{
+	expr *f = value_expr(v), *task;
+	if (f == NULL || f->type != EXPRFUTURE)
+		return v;
+	if (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) == FUTURE_DONE)
+		return f->result;
+
+	size_t roots = gc_roots_save();
+	gc_root_expr(&f);
+	future_run(ip, f);
+	while (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) != FUTURE_DONE) {
+		if ((task = future_next(ip)) != NULL) {
+			future_run(ip, task);
+		} else {
+			gc_safepoint(ip);
+			sched_yield();
+		}
+	}
+	gc_roots_restore(roots);
+	return f->result;
+}
+
+/*
+ * Replace the implicit futures of a pcall on the value stack by their
+ * values.
+ * Params:
+ *   args : the operator node followed by the argument nodes.
+ *   base : the index of the operator on the value stack.
+ */
+static void pcall_touch(interp * ip, node * args, size_t base)
+{
+	size_t roots = gc_roots_save();
+	gc_root_node(&args);
+	for (; args != NULL; args = args->next, base++) {
+		if (args->type == NODEFUTURE && args->implicit) {
+			/* This may move the stack. */
+			value v = future_touch(ip, self->vstack[base]);
+			self->vstack[base] = v;
+		}
+	}
+	gc_roots_restore(roots);
+}
+
+/* The `touch' procedure. */
+value touch(interp * ip, int argc, value * argv)
+{
+	if (argc != 1) {
+		print_err("Wrong number of arguments for touch: %d\n", argc);
+		exit(-1);
+	}
+	return future_touch(ip, argv[0]);
+}
+
+/**        READER: **/
+
+/* The initial buffer size of a streaming reader. */
+#define READER_BUFSIZE (1024 * 1024)
+
+/*
+ * The input of the reader. A regular file is mapped into memory as a
+ * whole. Other files, e.g. pipes and terminals, are read in chunks into
+ * a buffer, which grows if a single token does not fit into it. Tokens
+ * are parsed where they are in the buffer or mapping.
+ */
+typedef struct reader {
+	FILE *file;		/* NULL if the whole input is in buf. */
+	char *buf;
+	size_t pos;		/* The next unread byte. */
+	size_t len;		/* The end of the data in buf. */
+	size_t capacity;
+	size_t bytes;		/* The number of bytes read so far. */
+	bool mapped;
+} reader;
+
+/*
+ * Create a reader for a file. Regular files are mapped, everything else
+ * is streamed. The reader takes ownership of f.
+ */
+reader *reader_open_file(FILE * f)
+{
+	reader *r = calloc(1, sizeof(reader));
+	struct stat st;
+
+	if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)
+	    && st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				 fileno(f), 0);
+		if (map != MAP_FAILED) {
+			fclose(f);
+			r->buf = map;
+			r->len = r->capacity = r->bytes = st.st_size;
+			r->mapped = true;
+			return r;
+		}
+	}
+	setvbuf(f, NULL, _IOFBF, READER_BUFSIZE);
+	r->file = f;
+	r->capacity = READER_BUFSIZE;
+	r->buf = malloc(r->capacity);
+	return r;
+}
+
+/*
+ * Create a reader for a file name; "-" is the standard input.
+ * Returns:
+ *   the reader or NULL if the file could not be opened.
+ */
+reader *reader_open(const char *path)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (f == NULL)
+		return NULL;
+	return reader_open_file(f);
+}
+
+void reader_close(reader * r)
+{
+	if (r->mapped) {
+		munmap(r->buf, r->capacity);
+	} else {
+		free(r->buf);
+		if (r->file != NULL && r->file != stdin)
+			fclose(r->file);
+	}
+	free(r);
+}
+
+/*
+ * Read more input into the buffer. The unread bytes are moved to the
+ * start of the buffer first, so r->pos is 0 afterwards. The input is
+ * read line by line, which lets an interactive user type one form at a
+ * time.
+ * Returns:
+ *   false at the end of the input.
+ */
+static bool reader_fill(interp * ip, reader * r)
+{
+	if (r->file == NULL)
+		return false;
+	if (r->pos > 0) {
+		memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+	}
+	if (r->capacity - r->len < 2) {
+		r->capacity *= 2;
+		r->buf = realloc(r->buf, r->capacity);
+	}
+	/* Other threads may collect while this one waits for input. */
+	gc_block(ip);
+	char *line = fgets(r->buf + r->len, r->capacity - r->len, r->file);
+	gc_unblock(ip);
+	if (line == NULL)
+		return false;
+	size_t n = strlen(r->buf + r->len);
+	r->len += n;
+	r->bytes += n;
+	return true;
+}
+
+/*
+ * Make sure that at least n unread bytes are in the buffer.
+ * Returns:
+ *   false if the input ends before.
+ */
+static inline bool reader_ensure(interp * ip, reader * r, size_t n)
+{
+	while (r->len - r->pos < n) {
+		if (!reader_fill(ip, r))
+			return false;
+	}
+	return true;
+}
+
+static inline bool is_delimiter(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r'
+	    || c == '(' || c == ')' || c == ';';
+}
+
+/*
+ * Skip white space and comments, which run from `;' to the end of the
+ * line.
+ * Returns:
+ *   false at the end of the input.
+ */
+static bool reader_skip_space(interp * ip, reader * r)
+{
+	bool comment = false;
+	while (reader_ensure(ip, r, 1)) {
+		char c = r->buf[r->pos];
+		if (c == ';')
+			comment = true;
+		else if (c == '\n')
+			comment = false;
+		else if (!comment && c != ' ' && c != '\t' && c != '\r')
+			return true;
+		r->pos++;
+	}
+	return false;
+}
+
+/*
+ * Parse an integer token like strtoll with base 0, i.e. decimal,
+ * hexadecimal with 0x and octal with a leading 0. Values which do not
+ * fit into a long long become bignums.
+ * Returns:
+ *   the integer or NULL if the token is not an integer.
+ */
+static value parse_int(interp * ip, const char *s, size_t len)
+{
+	size_t i = 0, n = 0;
+	bool neg = false;
+	unsigned long long int v = 0, limit;
+	int base = 10, digit;
+	uint32_t *big = NULL;
+
+	if (len > 0 && (s[0] == '-' || s[0] == '+')) {
+		neg = s[0] == '-';
+		i++;
+	}
+	if (i == len)
+		return NULL;
+	if (len - i > 2 && s[i] == '0' && (s[i + 1] == 'x' || s[i + 1] == 'X')) {
+		base = 16;
+		i += 2;
+	} else if (len - i > 1 && s[i] == '0') {
+		base = 8;
+		i++;
+	}
+	limit = neg ? -(unsigned long long int)LLONG_MIN : LLONG_MAX;
+	for (; i < len; i++) {
+		char c = s[i];
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			digit = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			digit = c - 'A' + 10;
+		else {
+			free(big);
+			return NULL;
+		}
+		if (digit >= base) {
+			free(big);
+			return NULL;
+		}
+		if (big != NULL) {
+			n = mag_mul_add(big, n, base, digit);
+		} else if (v > (limit - digit) / base) {
+			/* Continue as a bignum. */
+			big = malloc((len / 8 + 3) * sizeof(uint32_t));
+			big[0] = (uint32_t) v;
+			big[1] = (uint32_t) (v >> 32);
+			n = mag_mul_add(big, mag_len(big, 2), base, digit);
+		} else {
+			v = v * base + digit;
+		}
+	}
+	if (big != NULL)
+		return big_result(ip, big, n, neg);
+	return make_int(ip, neg ? (long long int)-v : (long long int)v);
+}
+
+/*
+ * Read one expression. A list is built front to back: every element is
+ * consed once and stored into the cdr of the previous pair. While the
+ * reader waits for input, other threads may collect, so the list is a
+ * root.
+ * Returns:
+ *   the expression or NULL at the end of the input.
+ */
+static value read_form(interp * ip, reader * r)
+{
+	if (!reader_skip_space(ip, r))
+		return NULL;
+
+	char c = r->buf[r->pos];
+	if (c == '(') {
+		value list = VAL_EMPTY, last = VAL_EMPTY;
+		size_t roots = gc_roots_save();
+		gc_root_value(&list);
+		gc_root_value(&last);
+		r->pos++;
+		for (;;) {
+			if (!reader_skip_space(ip, r)) {
+				print_err("%s", "EOF not expected\n");
+				exit(-1);
+			}
+			if (r->buf[r->pos] == ')')
+				break;
+			value new = cons(ip, read_form(ip, r), VAL_EMPTY);
+			if (last == VAL_EMPTY) {
+				list = new;
+			} else {
+				value_pair(last)->cdr = new;
+				gc_write_barrier(ip, value_pair(last), new);
+			}
+			last = new;
+		}
+		r->pos++;
+		gc_roots_restore(roots);
+		return list;
+	} else if (c == ')') {
+		print_err("%s", "')' was not expected here\n");
+		exit(-1);
+	}
+
+	/* The empty list. */
+	if (c == '\'' && reader_ensure(ip, r, 3)
+	    && strncmp(r->buf + r->pos, "'()", 3) == 0) {
+		r->pos += 3;
+		return VAL_EMPTY;
+	}
+
+	/* Find the end of the token; it may continue in the next chunk. */
+	size_t tokenlen = 1;
+	while (reader_ensure(ip, r, tokenlen + 1)
+	       && !is_delimiter(r->buf[r->pos + tokenlen]))
+		tokenlen++;
+
+	const char *token = r->buf + r->pos;
+	value new = parse_int(ip, token, tokenlen);
+	if (new == NULL)
+		new = (value) create_exprsym(ip, intern_n(ip, token, tokenlen));
+	r->pos += tokenlen;
+
+	return new;
+}
+
+/* Read one expression in an interpreter; see read_form. */
+value read_expr(interp * ip, reader * r)
+{
+	worker *prev = interp_enter(ip);
+	value res = read_form(ip, r);
+	interp_leave(prev);
+	return res;
+}
+
+/*
+ * Read one expression from a string.
+ * Params:
+ *   s : the string; it is advanced behind the expression.
+ */
+value read(interp * ip, char *s[])
+{
+	debug_info("Read called with %s\n", *s);
+	reader r = { NULL, *s, 0, strlen(*s), 0, 0, false };
+	value e = read_expr(ip, &r);
+	if (e == NULL) {
+		print_err("%s", "EOF not expected\n");
+		exit(-1);
+	}
+	*s += r.pos;
+	return e;
+}
+
+/*
+ * Measure the throughput of the reader. All expressions of a file are
+ * read but not evaluated.
+ */
+int bench_read(interp * ip, const char *path)
+{
+	reader *r = reader_open(path);
+	if (r == NULL) {
+		print_err("Could not open %s.\n", path);
+		return 1;
+	}
+
+	struct timespec start, end;
+	size_t forms = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (read_expr(ip, r) != NULL) {
+		forms++;
+		gc_safepoint(ip);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double s = (end.tv_sec - start.tv_sec)
+	    + (end.tv_nsec - start.tv_nsec) / 1e9;
+	out_printf("%zu bytes, %zu forms in %.3f s (%s): %.1f MB/s\n",
+		   r->bytes, forms, s, r->mapped ? "mmap" : "stream",
+	       r->bytes / s / 1e6);
+	reader_close(r);
+	return 0;
+}
+
+/**        LAMBDA PREDEFINED FUNCTIONS: **/
+
+/*
+ * The arithmetic procedures. A call with two fixnums takes a fast path,
+ * which computes on the tagged values and checks for overflow with the
+ * compiler builtins. Everything else goes through the generic number
+ * operations, which promote to bignums.
+ */
+static void check_numbers(int argc, value * argv)
+{
+	int i;
+	for (i = 0; i < argc; i++) {
+		if (!is_number(argv[i])) {
+			print_err("%s", "Error Math without int\n");
+			exit(1);
+		}
+	}
+}
+
+/* (+ a ...) */
+value add(interp * ip, int argc, value * argv)
+{
+	intptr_t r;
+	int i;
+
+	/* (2a + 1) + (2b + 1) - 1 = 2(a + b) + 1 */
+	if (argc == 2 && is_fixnum(argv[0]) && is_fixnum(argv[1])
+	    && !__builtin_add_overflow((intptr_t) argv[0],
+				       (intptr_t) argv[1] - 1, &r))
+		return (value) r;
+
+	check_numbers(argc, argv);
+	value res = make_fixnum(0);
+	for (i = 0; i < argc; i++)
+		res = num_add(ip, res, argv[i], false);
+	return res;
+}
+
+/* (- a b ...) subtracts from a; (- a) negates. */
+value sub(interp * ip, int argc, value * argv)
+{
+	intptr_t r;
+	int i;
+
+	/* (2a + 1) - (2b + 1) + 1 = 2(a - b) + 1 */
+	if (argc == 2 && is_fixnum(argv[0]) && is_fixnum(argv[1])
+	    && !__builtin_sub_overflow((intptr_t) argv[0],
+				       (intptr_t) argv[1] - 1, &r))
+		return (value) r;
+
+	check_numbers(argc, argv);
+	if (argc == 0)
+		return make_fixnum(0);
+	if (argc == 1)
+		return num_add(ip, make_fixnum(0), argv[0], true);
+	value res = argv[0];
+	for (i = 1; i < argc; i++)
+		res = num_add(ip, res, argv[i], true);
+	return res;
+}
+
+/* (* a ...) */
+value mul(interp * ip, int argc, value * argv)
+{
+	intptr_t r;
+	int i;
+
+	/* a * 2b + 1 = 2ab + 1 */
+	if (argc == 2 && is_fixnum(argv[0]) && is_fixnum(argv[1])
+	    && !__builtin_mul_overflow(fixnum_value(argv[0]),
+				       (intptr_t) argv[1] - 1, &r))
+		return (value) (r + 1);
+
+	check_numbers(argc, argv);
+	value res = make_fixnum(1);
+	for (i = 0; i < argc; i++)
+		res = num_mul(ip, res, argv[i]);
+	return res;
+}
+
+/*
+ * Check that the arguments are ordered.
+ * Params:
+ *   sign : -1 for strictly increasing, 1 for strictly decreasing.
+ */
+static value compare(int argc, value * argv, int sign)
+{
+	int i;
+	check_numbers(argc, argv);
+	for (i = 1; i < argc; i++) {
+		if (num_cmp(argv[i - 1], argv[i]) * sign <= 0)
+			return VAL_FALSE;
+	}
+	return VAL_TRUE;
+}
+
+/* (< a b ...) */
+value less(interp * ip, int argc, value * argv)
+{
+	/* The tagging preserves the order of fixnums. */
+	if (argc == 2 && is_fixnum(argv[0]) && is_fixnum(argv[1]))
+		return make_bool((intptr_t) argv[0] < (intptr_t) argv[1]);
+	return compare(argc, argv, -1);
+}
+
+/* (> a b ...) */
+value greater(interp * ip, int argc, value * argv)
+{
+	if (argc == 2 && is_fixnum(argv[0]) && is_fixnum(argv[1]))
+		return make_bool((intptr_t) argv[0] > (intptr_t) argv[1]);
+	return compare(argc, argv, 1);
+}
+
+/**        VECTORS: **/
+
+/*
+ * Vectors hold unboxed 64 bit integers in a malloc'd array, which the
+ * finalizer of the expr pool frees. The bulk operations run on SIMD
+ * kernels selected at startup: AVX2 or SSE2 if the CPU has them,
+ * otherwise scalar loops.
+ *
+ * A kernel returns false if it cannot compute the exact result: on an
+ * overflow, or for the multiplications if an element does not fit into
+ * 32 bits, which the SIMD kernels require. The scalar kernel is then
+ * run, which only fails on an actual overflow. vector-sum and
+ * vector-dot fall back to bignums in that case.
+ */
+typedef struct simdkernels {
+	const char *name;
+	bool (*add) (int64_t * r, const int64_t * a, const int64_t * b,
+		     size_t n);
+	bool (*mul) (int64_t * r, const int64_t * a, const int64_t * b,
+		     size_t n);
+	bool (*sum) (const int64_t * a, size_t n, int64_t * res);
+	bool (*dot) (const int64_t * a, const int64_t * b, size_t n,
+		     int64_t * res);
+	int64_t(*max) (const int64_t * a, size_t n);
+} simdkernels;
+
+static bool scalar_add(int64_t * r, const int64_t * a, const int64_t * b,
+		       size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (__builtin_add_overflow(a[i], b[i], &r[i]))
+			return false;
+	}
+	return true;
+}
+
+static bool scalar_mul(int64_t * r, const int64_t * a, const int64_t * b,
+		       size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (__builtin_mul_overflow(a[i], b[i], &r[i]))
+			return false;
+	}
+	return true;
+}
+
+static bool scalar_sum(const int64_t * a, size_t n, int64_t * res)
+{
+	int64_t sum = 0;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (__builtin_add_overflow(sum, a[i], &sum))
+			return false;
+	}
+	*res = sum;
+	return true;
+}
+
+static bool scalar_dot(const int64_t * a, const int64_t * b, size_t n,
+		       int64_t * res)
+{
+	int64_t sum = 0, p;
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (__builtin_mul_overflow(a[i], b[i], &p)
+		    || __builtin_add_overflow(sum, p, &sum))
+			return false;
+	}
+	*res = sum;
+	return true;
+}
+
+static int64_t scalar_max(const int64_t * a, size_t n)
+{
+	int64_t max = a[0];
+	size_t i;
+	for (i = 1; i < n; i++) {
+		if (a[i] > max)
+			max = a[i];
+	}
+	return max;
+}
+
+static const simdkernels scalar_kernels = {
+	"scalar", scalar_add, scalar_mul, scalar_sum, scalar_dot, scalar_max
+};
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * SSE2 has no 64 bit multiplications and comparisons. Emulating them
+ * is slower than the scalar loops, so only addition and sum have SSE2
+ * kernels.
+ *
+ * The lanes in which x + y = s overflowed have their sign bit set.
+ */
+__attribute__ ((target("sse2")))
+static inline __m128i sse2_overflow(__m128i x, __m128i y, __m128i s)
+{
+	return _mm_and_si128(_mm_xor_si128(x, s), _mm_xor_si128(y, s));
+}
+
+__attribute__ ((target("sse2")))
+static bool sse2_add(int64_t * r, const int64_t * a, const int64_t * b,
+		     size_t n)
+{
+	__m128i overflow = _mm_setzero_si128();
+	size_t i;
+	for (i = 0; i + 2 <= n; i += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i s = _mm_add_epi64(x, y);
+		overflow = _mm_or_si128(overflow, sse2_overflow(x, y, s));
+		_mm_storeu_si128((__m128i *) (r + i), s);
+	}
+	if (_mm_movemask_pd(_mm_castsi128_pd(overflow)) != 0)
+		return false;
+	return scalar_add(r + i, a + i, b + i, n - i);
+}
+
+/* Add the partial sums in lanes to the sum of the n elements of a. */
+static bool sum_lanes(const int64_t * lanes, size_t nlanes,
+		      const int64_t * a, size_t n, int64_t * res)
+{
+	int64_t sum;
+	size_t i;
+	if (!scalar_sum(a, n, &sum))
+		return false;
+	for (i = 0; i < nlanes; i++) {
+		if (__builtin_add_overflow(sum, lanes[i], &sum))
+			return false;
+	}
+	*res = sum;
+	return true;
+}
+
+__attribute__ ((target("sse2")))
+static bool sse2_sum(const int64_t * a, size_t n, int64_t * res)
+{
+	__m128i acc = _mm_setzero_si128(), overflow = acc;
+	int64_t lanes[2];
+	size_t i;
+	for (i = 0; i + 2 <= n; i += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i s = _mm_add_epi64(acc, x);
+		overflow = _mm_or_si128(overflow, sse2_overflow(acc, x, s));
+		acc = s;
+	}
+	if (_mm_movemask_pd(_mm_castsi128_pd(overflow)) != 0)
+		return false;
+	_mm_storeu_si128((__m128i *) lanes, acc);
+	return sum_lanes(lanes, 2, a + i, n - i, res);
+}
+
+static const simdkernels sse2_kernels = {
+	"sse2", sse2_add, scalar_mul, sse2_sum, scalar_dot, scalar_max
+};
+
+__attribute__ ((target("avx2")))
+static inline __m256i avx2_overflow(__m256i x, __m256i y, __m256i s)
+{
+	return _mm256_and_si256(_mm256_xor_si256(x, s),
+				_mm256_xor_si256(y, s));
+}
+
+__attribute__ ((target("avx2")))
+static inline __m256i avx2_bits(__m256i bits, __m256i x, __m256i y)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	bits = _mm256_or_si256(bits,
+			       _mm256_xor_si256(x, _mm256_cmpgt_epi64(zero, x)));
+	return _mm256_or_si256(bits,
+			       _mm256_xor_si256(y, _mm256_cmpgt_epi64(zero, y)));
+}
+
+__attribute__ ((target("avx2")))
+static inline bool avx2_fits32(__m256i bits)
+{
+	const __m256i low = _mm256_set1_epi64x(INT32_MAX);
+	return _mm256_testz_si256(bits, _mm256_andnot_si256(low,
+							    _mm256_set1_epi8
+							    (-1)));
+}
+
+__attribute__ ((target("avx2")))
+static bool avx2_add(int64_t * r, const int64_t * a, const int64_t * b,
+		     size_t n)
+{
+	__m256i overflow = _mm256_setzero_si256();
+	size_t i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		__m256i s = _mm256_add_epi64(x, y);
+		overflow = _mm256_or_si256(overflow, avx2_overflow(x, y, s));
+		_mm256_storeu_si256((__m256i *) (r + i), s);
+	}
+	if (_mm256_movemask_pd(_mm256_castsi256_pd(overflow)) != 0)
+		return false;
+	return scalar_add(r + i, a + i, b + i, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static bool avx2_mul(int64_t * r, const int64_t * a, const int64_t * b,
+		     size_t n)
+{
+	__m256i bits = _mm256_setzero_si256();
+	size_t i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		bits = avx2_bits(bits, x, y);
+		_mm256_storeu_si256((__m256i *) (r + i),
+				    _mm256_mul_epi32(x, y));
+	}
+	return avx2_fits32(bits) && scalar_mul(r + i, a + i, b + i, n - i);
+}
+
+__attribute__ ((target("avx2")))
+static bool avx2_sum(const int64_t * a, size_t n, int64_t * res)
+{
+	__m256i acc = _mm256_setzero_si256(), overflow = acc;
+	int64_t lanes[4];
+	size_t i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i s = _mm256_add_epi64(acc, x);
+		overflow = _mm256_or_si256(overflow, avx2_overflow(acc, x, s));
+		acc = s;
+	}
+	if (_mm256_movemask_pd(_mm256_castsi256_pd(overflow)) != 0)
+		return false;
+	_mm256_storeu_si256((__m256i *) lanes, acc);
+	return sum_lanes(lanes, 4, a + i, n - i, res);
+}
+
+__attribute__ ((target("avx2")))
+static bool avx2_dot(const int64_t * a, const int64_t * b, size_t n,
+		     int64_t * res)
+{
+	__m256i acc = _mm256_setzero_si256(), overflow = acc, bits = acc;
+	int64_t lanes[4], tail;
+	size_t i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		__m256i p = _mm256_mul_epi32(x, y);
+		bits = avx2_bits(bits, x, y);
+		__m256i s = _mm256_add_epi64(acc, p);
+		overflow = _mm256_or_si256(overflow, avx2_overflow(acc, p, s));
+		acc = s;
+	}
+	if (_mm256_movemask_pd(_mm256_castsi256_pd(overflow)) != 0
+	    || !avx2_fits32(bits))
+		return false;
+	_mm256_storeu_si256((__m256i *) lanes, acc);
+	if (!scalar_dot(a + i, b + i, n - i, &tail))
+		return false;
+	return sum_lanes(lanes, 4, &tail, 1, res);
+}
+
+__attribute__ ((target("avx2")))
+static int64_t avx2_max(const int64_t * a, size_t n)
+{
+	int64_t lanes[4], max;
+	size_t i;
+	if (n < 4)
+		return scalar_max(a, n);
+
+	__m256i m = _mm256_loadu_si256((const __m256i *)a);
+	for (i = 4; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		m = _mm256_blendv_epi8(m, x, _mm256_cmpgt_epi64(x, m));
+	}
+	_mm256_storeu_si256((__m256i *) lanes, m);
+	max = scalar_max(lanes, 4);
+	for (; i < n; i++) {
+		if (a[i] > max)
+			max = a[i];
+	}
+	return max;
+}
+
+static const simdkernels avx2_kernels = {
+	"avx2", avx2_add, avx2_mul, avx2_sum, avx2_dot, avx2_max
+};
+
+#endif
+
+static const simdkernels *simd = &scalar_kernels;
+
+/*
+ * Select the SIMD kernels.
+ * Params:
+ *   name : "avx2", "sse2" or "scalar", or NULL for the best one the CPU
+ *          supports.
+ * Returns:
+ *   false if the kernels are not available.
+ */
+bool simd_init(const char *name)
+{
+	const simdkernels *best = &scalar_kernels;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		best = &avx2_kernels;
+	else if (__builtin_cpu_supports("sse2"))
+		best = &sse2_kernels;
+#endif
+	if (name == NULL) {
+		simd = best;
+		return true;
+	}
+	if (strcmp(name, "scalar") == 0) {
+		simd = &scalar_kernels;
+		return true;
+	}
+#ifdef HAVE_X86_SIMD
+	if (strcmp(name, "sse2") == 0 && best != &scalar_kernels) {
+		simd = &sse2_kernels;
+		return true;
+	}
+	if (strcmp(name, "avx2") == 0 && best == &avx2_kernels) {
+		simd = &avx2_kernels;
+		return true;
+	}
+#endif
+	return false;
+}
+
+static expr *create_vector(interp * ip, size_t length)
+{
+	int64_t *elements = calloc(length > 0 ? length : 1, sizeof(int64_t));
+	if (elements == NULL) {
+		print_err("Could not allocate a vector of length %zu.\n",
+			  length);
+		exit(-1);
+	}
+	expr *v = create_expr(ip, EXPRVECTOR);
+	v->elements = elements;
+	v->length = length;
+	return v;
+}
+
+static expr *get_vector(value v, const char *proc)
+{
+	expr *e = value_expr(v);
+	if (e == NULL || e->type != EXPRVECTOR) {
+		print_err("%s expects a vector.\n", proc);
+		exit(-1);
+	}
+	return e;
+}
+
+/* An element value or index; it must fit into 64 bits. */
+static int64_t get_element(value v, const char *proc)
+{
+	if (!is_int(v)) {
+		print_err("%s expects a 64 bit integer.\n", proc);
+		exit(-1);
+	}
+	return get_int(v);
+}
+
+static size_t get_index(expr * vec, value v, const char *proc)
+{
+	int64_t i = get_element(v, proc);
+	if (i < 0 || (uint64_t) i >= vec->length) {
+		print_err("%s: index %lld out of range.\n", proc,
+			  (long long int)i);
+		exit(-1);
+	}
+	return i;
+}
+
+static void check_argc(int argc, int min, int max, const char *proc)
+{
+	if (argc < min || argc > max) {
+		print_err("Wrong number of arguments for %s: %d\n", proc,
+			  argc);
+		exit(-1);
+	}
+}
+
+/* (make-vector n [fill]) */
+value make_vector(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 1, 2, "make-vector");
+	int64_t n = get_element(argv[0], "make-vector");
+	int64_t fill = argc == 2 ? get_element(argv[1], "make-vector") : 0;
+	size_t i;
+	if (n < 0) {
+		print_err("%s", "make-vector expects a length >= 0.\n");
+		exit(-1);
+	}
+	expr *v = create_vector(ip, n);
+	for (i = 0; fill != 0 && i < v->length; i++)
+		v->elements[i] = fill;
+	return (value) v;
+}
+
+/* (vector-ref v i) */
+value vector_ref(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 2, 2, "vector-ref");
+	expr *v = get_vector(argv[0], "vector-ref");
+	return make_int(ip, v->elements[get_index(v, argv[1], "vector-ref")]);
+}
+
+/* (vector-set! v i x) */
+value vector_set(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 3, 3, "vector-set!");
+	expr *v = get_vector(argv[0], "vector-set!");
+	size_t i = get_index(v, argv[1], "vector-set!");
+	v->elements[i] = get_element(argv[2], "vector-set!");
+	return VAL_EMPTY;
+}
+
+/* (vector-length v) */
+value vector_length(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 1, 1, "vector-length");
+	return make_int(ip, get_vector(argv[0], "vector-length")->length);
+}
+
+/* The two vectors of an element-wise operation. */
+static void get_vector_pair(int argc, value * argv, const char *proc,
+			    expr ** a, expr ** b)
+{
+	check_argc(argc, 2, 2, proc);
+	*a = get_vector(argv[0], proc);
+	*b = get_vector(argv[1], proc);
+	if ((*a)->length != (*b)->length) {
+		print_err("%s expects vectors of the same length.\n", proc);
+		exit(-1);
+	}
+}
+
+/* (vector-add a b) */
+value vector_add(interp * ip, int argc, value * argv)
+{
+	expr *a, *b;
+	get_vector_pair(argc, argv, "vector-add", &a, &b);
+	expr *r = create_vector(ip, a->length);
+	if (!simd->add(r->elements, a->elements, b->elements, a->length)
+	    && !scalar_add(r->elements, a->elements, b->elements, a->length)) {
+		print_err("%s", "vector-add: overflow.\n");
+		exit(-1);
+	}
+	return (value) r;
+}
+
+/* (vector-mul a b) */
+value vector_mul(interp * ip, int argc, value * argv)
+{
+	expr *a, *b;
+	get_vector_pair(argc, argv, "vector-mul", &a, &b);
+	expr *r = create_vector(ip, a->length);
+	if (!simd->mul(r->elements, a->elements, b->elements, a->length)
+	    && !scalar_mul(r->elements, a->elements, b->elements, a->length)) {
+		print_err("%s", "vector-mul: overflow.\n");
+		exit(-1);
+	}
+	return (value) r;
+}
+
+/* (vector-sum v) */
+value vector_sum(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 1, 1, "vector-sum");
+	expr *v = get_vector(argv[0], "vector-sum");
+	int64_t sum;
+	size_t i;
+	if (simd->sum(v->elements, v->length, &sum)
+	    || scalar_sum(v->elements, v->length, &sum))
+		return make_int(ip, sum);
+
+	value res = make_fixnum(0);
+	for (i = 0; i < v->length; i++)
+		res = num_add(ip, res, make_int(ip, v->elements[i]), false);
+	return res;
+}
+
+/* (vector-dot a b) */
+value vector_dot(interp * ip, int argc, value * argv)
+{
+	expr *a, *b;
+	int64_t dot;
+	size_t i;
+	get_vector_pair(argc, argv, "vector-dot", &a, &b);
+	if (simd->dot(a->elements, b->elements, a->length, &dot)
+	    || scalar_dot(a->elements, b->elements, a->length, &dot))
+		return make_int(ip, dot);
+
+	value res = make_fixnum(0);
+	for (i = 0; i < a->length; i++)
+		res = num_add(ip, res,
+			      num_mul(ip, make_int(ip, a->elements[i]),
+				      make_int(ip, b->elements[i])), false);
+	return res;
+}
+
+/* (vector-max v) */
+value vector_max(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 1, 1, "vector-max");
+	expr *v = get_vector(argv[0], "vector-max");
+	if (v->length == 0) {
+		print_err("%s", "vector-max of an empty vector.\n");
+		exit(-1);
+	}
+	return make_int(ip, simd->max(v->elements, v->length));
+}
+
+/**        PAIRS: **/
+
+static value get_pair(value v, const char *proc)
+{
+	if (!is_pair(v)) {
+		print_err("%s expects a pair.\n", proc);
+		exit(-1);
+	}
+	return v;
+}
+
+/* (cons a d) */
+value cons_proc(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 2, 2, "cons");
+	return cons(ip, argv[0], argv[1]);
+}
+
+/* (car p) */
+value car_proc(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 1, 1, "car");
+	return car(get_pair(argv[0], "car"));
+}
+
+/* (cdr p) */
+value cdr_proc(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 1, 1, "cdr");
+	return cdr(get_pair(argv[0], "cdr"));
+}
+
+/* (null? x) */
+value null_proc(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 1, 1, "null?");
+	return make_bool(argv[0] == VAL_EMPTY);
+}
+
+/* (list x ...); the list is built from the back, one pair per element. */
+value list_proc(interp * ip, int argc, value * argv)
+{
+	value l = VAL_EMPTY;
+	while (argc-- > 0)
+		l = cons(ip, argv[argc], l);
+	return l;
+}
+
+/*
+ * The counters which `stats' reports, by name: the offset of either a
+ * counter of the threads, which is summed up, or a counter of the
+ * interpreter.
+ */
+#define COUNTER(field) offsetof(struct counters, field), false
+#define GC_COUNTER(field) offsetof(interp, field), true
+
+static const struct {
+	const char *name;
+	size_t offset;
+	bool in_interp;
+} stat_counters[] = {
+	{"eval-const", COUNTER(evals[NODECONST])},
+	{"eval-local", COUNTER(evals[NODELOCAL])},
+	{"eval-global", COUNTER(evals[NODEGLOBAL])},
+	{"eval-lambda", COUNTER(evals[NODELAMBDA])},
+	{"eval-define", COUNTER(evals[NODEDEFINE])},
+	{"eval-set", COUNTER(evals[NODESET])},
+	{"eval-if", COUNTER(evals[NODEIF])},
+	{"eval-begin", COUNTER(evals[NODEBEGIN])},
+	{"eval-call", COUNTER(evals[NODECALL])},
+	{"eval-future", COUNTER(evals[NODEFUTURE])},
+	{"eval-pcall", COUNTER(evals[NODEPCALL])},
+	{"lambda-applications", COUNTER(applications)},
+	{"proc-calls", COUNTER(proc_calls)},
+	{"lookups", COUNTER(lookups)},
+	{"lookup-hops", COUNTER(hops)},
+	{"alloc-expressions", COUNTER(allocations[0])},
+	{"alloc-environments", COUNTER(allocations[1])},
+	{"alloc-dict-entries", COUNTER(allocations[2])},
+	{"alloc-nodes", COUNTER(allocations[3])},
+	{"alloc-pairs", COUNTER(allocations[4])},
+	{"heap-bytes", GC_COUNTER(gc_heap_bytes)},
+	{"nursery-bytes", GC_COUNTER(gc_young_bytes)},
+	{"minor-gcs", GC_COUNTER(gc_counters.minor_gcs)},
+	{"major-gcs", GC_COUNTER(gc_counters.major_gcs)},
+	{"gc-pause-ns", GC_COUNTER(gc_counters.gc_ns)},
+	{"gc-max-pause-ns", GC_COUNTER(gc_counters.gc_max_ns)},
+};
+
+#undef COUNTER
+#undef GC_COUNTER
+
+#define NSTATS (sizeof(stat_counters) / sizeof(stat_counters[0]))
+
+/* The current value of counter i of stat_counters. */
+static size_t stat_value(interp * ip, size_t i)
+{
+	size_t sum = 0;
+	int w;
+	if (stat_counters[i].in_interp)
+		return *(size_t *) ((char *)ip + stat_counters[i].offset);
+	for (w = 0; w < ip->nworkers; w++)
+		sum += *(size_t *) ((char *)&ip->workers[w]->counters
+				    + stat_counters[i].offset);
+	return sum;
+}
+
+/* The number of objects allocated in a pool by all threads. */
+static size_t pool_allocations(interp * ip, const pool * p)
+{
+	size_t sum = 0;
+	int w;
+	for (w = 0; w < ip->nworkers; w++)
+		sum += ip->workers[w]->counters.allocations[p->id];
+	return sum;
+}
+
+/*
+ * The `stats' procedure. Without arguments, it prints all counters. With
+ * a quoted counter name, e.g. (stats (quote lookups)), it returns the
+ * counter. The reader has no ' shorthand besides '().
+ */
+value stats(interp * ip, int argc, value * argv)
+{
+	size_t i;
+
+	if (argc == 0) {
+		for (i = 0; i < NSTATS; i++)
+			out_printf("%s %zu\n", stat_counters[i].name,
+				   stat_value(ip, i));
+		return VAL_EMPTY;
+	}
+	expr *name = value_expr(argv[0]);
+	if (argc == 1 && name != NULL && name->type == EXPRSYM) {
+		for (i = 0; i < NSTATS; i++) {
+			if (strcmp(stat_counters[i].name,
+				   name->symvalue->name) == 0)
+				return make_int(ip, stat_value(ip, i));
+		}
+	}
+	print_err("%s", "stats expects no argument or a counter name.\n");
+	exit(-1);
+}
+
+/* Print all counters to stderr; installed with atexit by --stats. */
+void stats_dump(interp * ip)
+{
+	size_t i;
+	for (i = 0; i < NSTATS; i++)
+		fprintf(stderr, "%s %zu\n", stat_counters[i].name,
+			stat_value(ip, i));
+}
+
+value save_image(interp * ip, int argc, value * argv);
+
+/* The builtin procedures, by name. */
+static const struct {
+	const char *name;
+	 value(*proc) (interp * ip, int argc, value * argv);
+} builtins[] = {
+	{"gc", gc},
+	{"stats", stats},
+	{"+", add},
+	{"-", sub},
+	{"*", mul},
+	{"<", less},
+	{">", greater},
+	{"make-vector", make_vector},
+	{"vector-ref", vector_ref},
+	{"vector-set!", vector_set},
+	{"vector-length", vector_length},
+	{"vector-add", vector_add},
+	{"vector-mul", vector_mul},
+	{"vector-sum", vector_sum},
+	{"vector-dot", vector_dot},
+	{"vector-max", vector_max},
+	{"cons", cons_proc},
+	{"car", car_proc},
+	{"cdr", cdr_proc},
+	{"null?", null_proc},
+	{"list", list_proc},
+	{"touch", touch},
+	{"save-image", save_image},
+};
+
+#define NBUILTINS (sizeof(builtins) / sizeof(builtins[0]))
+
+/*
+ * Inititalizes an environment with global values.
+ * Params:
+ *   en : the environment which should be initialized.
+ */
+void init_global(interp * ip, env * en)
+{
+	size_t i;
+
+	add_to_env(ip, en, ip->sym_true, VAL_TRUE, false);
+	add_to_env(ip, en, ip->sym_false, VAL_FALSE, false);
+	for (i = 0; i < NBUILTINS; i++) {
+		expr *proc = create_exprproc(ip, builtins[i].proc);
+		add_to_env(ip, en, intern(ip, builtins[i].name), (value) proc,
+			   false);
+	}
+}
+
+/**        IMAGES: **/
+
+/*
+ * (save-image (quote file)) writes everything which is reachable from
+ * the global environment into an image: the frames and their bindings,
+ * closures and their analyzed lambdas, lists, numbers and vectors.
+ * `miniclisp --image file' starts with the global environment of the
+ * image instead of reading and evaluating the definitions again. The
+ * reader has no strings, so the file name is a symbol: it cannot
+ * contain white space, parentheses or `;'.
+ *
+ * The objects are written as they are laid out in memory, in slabs
+ * like those of the old generation, so the loader maps the image and
+ * links its slabs into the pools; loading does not copy the objects.
+ * The file consists of:
+ *  - an imageheader, padded to SLAB_SIZE,
+ *  - the area: the slabs, followed by the data which objects own
+ *    outside of the pools (lambdas and their frame layouts, the
+ *    bindings of frames, the digits of bignums and the elements of
+ *    vectors),
+ *  - the fixups: the words of the area which refer to a symbol, a
+ *    builtin or a native procedure. They are filled in by name, since
+ *    symbols are interned again and procedures are taken from the
+ *    builtins table and the registry of native procedures,
+ *  - the offsets of the lambdas, which are registered with the
+ *    collector,
+ *  - the relocations: the indices of the words of the area which hold
+ *    an address,
+ *  - the names of the symbols.
+ * The addresses in the area are those of the area at IMAGE_BASE. The
+ * loader maps it there if it can; otherwise it maps it elsewhere and
+ * moves every relocation by the difference. If the executable has been
+ * loaded at another address than the one which wrote the image, the
+ * handlers of the nodes are set from their types. Code objects and
+ * inline caches are not saved, they are filled in again when they are
+ * used. Pages of the area are copied on write, so an image which is
+ * loaded several times is shared until the objects are changed.
+ *
+ * Loading takes time in proportion to the symbols and procedures the
+ * image refers to, plus the nodes if the handlers are set, instead of
+ * to the whole heap. With 10000 definitions (an 806 KB script, a 16 MB
+ * image of which 8 MB are nodes), a run takes 127 ms from the script
+ * and 31 ms from the image, or 17 ms if the executable is not position
+ * independent and the pages of the nodes are not copied. A run without
+ * either takes 5 ms.
+ *
+ * An image is trusted like the executable: the loader checks the
+ * header, the tables and the slab headers, but not the objects.
+ */
+
+#define IMAGE_MAGIC "MCLIMAGE"
+#define IMAGE_VERSION 2
+
+/*
+ * The address of the area of an image. It is far from those which
+ * malloc and mmap use, so the area can usually be mapped there.
+ */
+#if UINTPTR_MAX > 0xffffffffu
+#define IMAGE_BASE ((uintptr_t) 0x3e0000000000)
+#else
+#define IMAGE_BASE ((uintptr_t) 0x30000000)
+#endif
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/* The layout the objects of an image depend on. */
+static const uint32_t image_layout[] = {
+	sizeof(void *), SLAB_SIZE, sizeof(slab), sizeof(expr), sizeof(env),
+	sizeof(dictentry), sizeof(node), sizeof(pair), sizeof(lambdainfo),
+	sizeof(freevar), NPOOLS, NNODETYPES
+};
+
+#define IMAGE_LAYOUT_SIZE (sizeof(image_layout) / sizeof(image_layout[0]))
+
+typedef struct imageheader {
+	char magic[8];
+	uint32_t version;
+	uint32_t layout[IMAGE_LAYOUT_SIZE];
+	uint64_t base;		/* The address the area is written for. */
+	uint64_t heap_size;	/* The slabs. */
+	uint64_t data_size;	/* The memory which objects own. */
+	uint64_t global_env;	/* The address of the global environment. */
+	uint64_t handlers;	/* The address of eval_const. */
+	uint64_t nfixups;
+	uint64_t nlambdas;
+	uint64_t nrelocs;
+	uint64_t nnames;
+	uint64_t names_size;	/* Each name is a 32 bit length and bytes. */
+} imageheader;
+
+/*
+ * How a fixup refers to its name: a symbol pointer is stored in the
+ * word, or the word is an expr which gets the symbol, the builtin or
+ * the native procedure of that name.
+ */
+enum imagefixupkind { FIXUP_SYMBOL, FIXUP_SYMEXPR, FIXUP_PROC,
+	FIXUP_NATIVE
+};
+
+typedef struct imagefixup {
+	uint64_t at;		/* The offset in the area. */
+	uint32_t kind;
+	uint32_t name;
+} imagefixup;
+
+/* The kinds of objects in an image; pooled ones by pool id. */
+enum imagekind { IMAGE_EXPR, IMAGE_ENV, IMAGE_DICT, IMAGE_NODE,
+	IMAGE_PAIR, IMAGE_LAMBDA
+};
+
+/*
+ * A position in an image which is being written: an offset in the
+ * slabs or, with IMAGE_DATA set, in the data. The area offset of the
+ * data is known once everything has been written.
+ */
+#define IMAGE_DATA ((uint64_t) 1 << 63)
+
+typedef struct imageobject {
+	const void *obj;
+	uint64_t pos;
+	enum imagekind kind;
+} imageobject;
+
+typedef struct imagereloc {
+	uint64_t at;		/* The position of the address. */
+	bool data;		/* Whether the address is one of the data. */
+} imagereloc;
+
+typedef struct imagewriter {
+	interp *ip;
+	/* The slabs and the data, as they are written to the file. */
+	char *heap;
+	size_t heap_size;
+	size_t heap_capacity;
+	char *data;
+	size_t data_size;
+	size_t data_capacity;
+	/* The position of the slab each pool allocates from or SIZE_MAX. */
+	size_t slabs[NPOOLS];
+	/* Maps objects to their positions and symbols to their names. */
+	const void **keys;
+	uint64_t *positions;
+	size_t nkeys;
+	size_t table_size;
+	/* The objects which have a position, in the order they got it. */
+	imageobject *objects;
+	size_t nobjects;
+	size_t objects_capacity;
+	imagereloc *relocs;
+	size_t nrelocs;
+	size_t relocs_capacity;
+	imagefixup *fixups;
+	size_t nfixups;
+	size_t fixups_capacity;
+	uint64_t *lambdas;
+	size_t nlambdas;
+	size_t lambdas_capacity;
+	symbol **names;
+	size_t nnames;
+	size_t names_capacity;
+} imagewriter;
+
+/* Make room for one more element of size `size' in an array. */
+static void *image_grow(void *array, size_t n, size_t *capacity,
+			size_t size)
+{
+	if (n == *capacity) {
+		*capacity = *capacity == 0 ? 1024 : *capacity * 2;
+		array = realloc(array, *capacity * size);
+	}
+	return array;
+}
+
+static char *image_at(imagewriter * w, uint64_t pos)
+{
+	return pos & IMAGE_DATA ? w->data + (pos & ~IMAGE_DATA)
+	    : w->heap + pos;
+}
+
+/* Returns the offset of a position in the area. */
+static uint64_t image_offset(imagewriter * w, uint64_t pos)
+{
+	return pos & IMAGE_DATA ? w->heap_size + (pos & ~IMAGE_DATA) : pos;
+}
+
+/* Returns the position of a new object in the slabs of a pool. */
+static uint64_t image_alloc(imagewriter * w, int pool_id)
+{
+	size_t objsize = w->ip->pools[pool_id]->objsize;
+	size_t at = w->slabs[pool_id];
+	slab *sl = at == SIZE_MAX ? NULL : (slab *) (w->heap + at);
+
+	if (sl == NULL
+	    || SLAB_HEADER_SIZE + (sl->nobjects + 1) * objsize > SLAB_SIZE) {
+		if (w->heap_size == w->heap_capacity) {
+			w->heap_capacity = w->heap_capacity == 0 ? SLAB_SIZE
+			    : w->heap_capacity * 2;
+			w->heap = realloc(w->heap, w->heap_capacity);
+		}
+		at = w->slabs[pool_id] = w->heap_size;
+		w->heap_size += SLAB_SIZE;
+		sl = (slab *) (w->heap + at);
+		memset(sl, 0, SLAB_SIZE);
+		/* The loader replaces the pool id by the pool. */
+		sl->pool = (pool *) (uintptr_t) pool_id;
+	}
+	return at + SLAB_HEADER_SIZE + sl->nobjects++ * objsize;
+}
+
+/*
+ * Returns the position of zeroed memory in the data. Every block has
+ * a size, so that it lies within the area.
+ */
+static uint64_t image_alloc_data(imagewriter * w, size_t size)
+{
+	size_t at = w->data_size;
+	size = size == 0 ? 8 : (size + 7) & ~(size_t) 7;
+	while (w->data_size + size > w->data_capacity) {
+		w->data_capacity = w->data_capacity == 0 ? 4096
+		    : w->data_capacity * 2;
+		w->data = realloc(w->data, w->data_capacity);
 	}
+	memset(w->data + at, 0, size);
+	w->data_size += size;
+	return at | IMAGE_DATA;
+}
+
+static size_t image_slot(imagewriter * w, const void *obj)
+{
+	size_t i = ((uintptr_t) obj >> 3) * 2654435761u & (w->table_size - 1);
+	while (w->keys[i] != NULL && w->keys[i] != obj)
+		i = (i + 1) & (w->table_size - 1);
+	return i;
+}
+
+/* Returns the slot of a key in the table, which may be empty. */
+static size_t image_find(imagewriter * w, const void *obj)
+{
+	size_t i;
+
+	if (w->nkeys * 2 >= w->table_size) {
+		const void **keys = w->keys;
+		uint64_t *positions = w->positions;
+		size_t size = w->table_size;
+		w->table_size = size == 0 ? 1024 : size * 2;
+		w->keys = calloc(w->table_size, sizeof(void *));
+		w->positions = malloc(w->table_size * sizeof(uint64_t));
+		for (i = 0; i < size; i++) {
+			if (keys[i] != NULL) {
+				size_t slot = image_slot(w, keys[i]);
+				w->keys[slot] = keys[i];
+				w->positions[slot] = positions[i];
+			}
+		}
+		free(keys);
+		free(positions);
+	}
+	return image_slot(w, obj);
+}
+
+/*
+ * Returns the position of an object. An object which has none yet gets
+ * one; it is written by image_write_object later.
+ */
+static uint64_t image_position(imagewriter * w, const void *obj,
+			       enum imagekind kind)
+{
+	size_t i = image_find(w, obj);
+
+	if (w->keys[i] == NULL) {
+		uint64_t pos = kind == IMAGE_LAMBDA
+		    ? image_alloc_data(w, sizeof(lambdainfo))
+		    : image_alloc(w, kind);
+		w->keys[i] = obj;
+		w->positions[i] = pos;
+		w->nkeys++;
+		w->objects = image_grow(w->objects, w->nobjects,
+					&w->objects_capacity,
+					sizeof(imageobject));
+		w->objects[w->nobjects].obj = obj;
+		w->objects[w->nobjects].pos = pos;
+		w->objects[w->nobjects].kind = kind;
+		w->nobjects++;
+	}
+	return w->positions[i];
+}
+
+/*
+ * Returns the address of the position pos, which is stored at the
+ * position at. Until image_relocate makes it an address of the area,
+ * it is the offset in the slabs or the data.
+ */
+static uintptr_t image_address(imagewriter * w, uint64_t at, uint64_t pos)
+{
+	w->relocs = image_grow(w->relocs, w->nrelocs, &w->relocs_capacity,
+			       sizeof(imagereloc));
+	w->relocs[w->nrelocs].at = at;
+	w->relocs[w->nrelocs].data = (pos & IMAGE_DATA) != 0;
+	w->nrelocs++;
+	return (uintptr_t) (pos & ~IMAGE_DATA);
+}
+
+/* Returns the address of an object, which is stored at `at'. */
+static uintptr_t image_ref(imagewriter * w, uint64_t at, const void *obj,
+			   enum imagekind kind)
+{
+	if (obj == NULL)
+		return 0;
+	return image_address(w, at, image_position(w, obj, kind));
+}
+
+/* Returns a value as it is stored at `at'. */
+static value image_value(imagewriter * w, uint64_t at, value v)
+{
+	expr *e = value_expr(v);
+
+	if (v == NULL)
+		return NULL;
+	if (is_pair(v))
+		return (value) (image_ref(w, at, value_pair(v), IMAGE_PAIR)
+				+ PAIR_TAG);
+	if (e == NULL)
+		return v;
+	if (e->type == EXPRFUTURE) {
+		/* A future is replaced by its value. */
+		if (__atomic_load_n(&e->state, __ATOMIC_ACQUIRE)
+		    != FUTURE_DONE) {
+			print_err("%s", "Cannot save a running future.\n");
+			exit(-1);
+		}
+		return image_value(w, at, e->result);
+	}
+	return (value) image_ref(w, at, e, IMAGE_EXPR);
+}
+
+/* Record that the word or the expr at `at' refers to a symbol. */
+static void image_name(imagewriter * w, uint64_t at, symbol * s,
+		       enum imagefixupkind kind)
+{
+	size_t i;
+
+	if (s == NULL)
+		return;
+	i = image_find(w, s);
+	if (w->keys[i] == NULL) {
+		w->keys[i] = s;
+		w->positions[i] = w->nnames;
+		w->nkeys++;
+		w->names = image_grow(w->names, w->nnames, &w->names_capacity,
+				      sizeof(symbol *));
+		w->names[w->nnames++] = s;
+	}
+	w->fixups = image_grow(w->fixups, w->nfixups, &w->fixups_capacity,
+			       sizeof(imagefixup));
+	w->fixups[w->nfixups].at = at;
+	w->fixups[w->nfixups].kind = kind;
+	w->fixups[w->nfixups].name = w->positions[i];
+	w->nfixups++;
+}
+
+static void image_builtin(imagewriter * w, uint64_t at, expr * e)
+{
+	size_t i;
+	for (i = 0; i < NBUILTINS; i++) {
+		if (builtins[i].proc == e->proc) {
+			image_name(w, at, intern(w->ip, builtins[i].name),
+				   FIXUP_PROC);
+			return;
+		}
+	}
+	print_err("%s", "Cannot save an unknown procedure.\n");
+	exit(-1);
+}
+
+/* The position of a field of the object at pos. */
+#define IMAGE_FIELD(pos, type, field) ((pos) + offsetof(type, field))
+
+static void image_write_expr(imagewriter * w, const expr * e, uint64_t pos)
+{
+	expr c;
+	uint64_t at;
+
+	memset(&c, 0, sizeof(c));
+	c.type = e->type;
+	switch (e->type) {
+	case EXPRPROC:
+		image_builtin(w, pos, (expr *) e);
+		break;
+	case EXPRNATIVE:
+		image_name(w, pos, e->nativename, FIXUP_NATIVE);
+		break;
+	case EXPRSYM:
+		image_name(w, pos, e->symvalue, FIXUP_SYMEXPR);
+		break;
+	case EXPRINT:
+		c.intvalue = e->intvalue;
+		break;
+	case EXPRBIG:
+		at = image_alloc_data(w, e->ndigits * sizeof(uint32_t));
+		memcpy(image_at(w, at), e->digits,
+		       e->ndigits * sizeof(uint32_t));
+		c.digits = (uint32_t *)
+		    image_address(w, IMAGE_FIELD(pos, expr, digits), at);
+		c.ndigits = e->ndigits;
+		c.negative = e->negative;
+		break;
+	case EXPRVECTOR:
+		at = image_alloc_data(w, e->length * sizeof(int64_t));
+		memcpy(image_at(w, at), e->elements,
+		       e->length * sizeof(int64_t));
+		c.elements = (int64_t *)
+		    image_address(w, IMAGE_FIELD(pos, expr, elements), at);
+		c.length = e->length;
+		break;
+	case EXPRLAMBDA:
+		c.lambdavars = image_value(w, IMAGE_FIELD(pos, expr, lambdavars),
+					   e->lambdavars);
+		c.lambdaexpr = image_value(w, IMAGE_FIELD(pos, expr, lambdaexpr),
+					   e->lambdaexpr);
+		c.lambdaenv = (env *) image_ref(w, IMAGE_FIELD(pos, expr,
+							       lambdaenv),
+						e->lambdaenv, IMAGE_ENV);
+		c.lambdainfo = (lambdainfo *)
+		    image_ref(w, IMAGE_FIELD(pos, expr, lambdainfo),
+			      e->lambdainfo, IMAGE_LAMBDA);
+		break;
+	case EXPRFUTURE:
+		/* Replaced by image_value. */
+		break;
+	}
+	memcpy(image_at(w, pos), &c, sizeof(c));
+}
+
+static void image_write_node(imagewriter * w, const node * n, uint64_t pos)
+{
+	node c;
+
+	/* The caches start empty. */
+	memset(&c, 0, sizeof(c));
+	c.eval = n->eval;
+	c.type = n->type;
+	c.next = (node *) image_ref(w, IMAGE_FIELD(pos, node, next), n->next,
+				    IMAGE_NODE);
+	switch (n->type) {
+	case NODECONST:
+		c.constant = image_value(w, IMAGE_FIELD(pos, node, constant),
+					 n->constant);
+		break;
+	case NODELOCAL:
+		c.depth = n->depth;
+		c.slot = n->slot;
+		break;
+	case NODEGLOBAL:
+		c.cell = (dictentry *) image_ref(w, IMAGE_FIELD(pos, node, cell),
+						 n->cell, IMAGE_DICT);
+		break;
+	case NODEDEFINE:
+	case NODESET:
+		image_name(w, IMAGE_FIELD(pos, node, target), n->target,
+			   FIXUP_SYMBOL);
+		c.valuenode = (node *)
+		    image_ref(w, IMAGE_FIELD(pos, node, valuenode),
+			      n->valuenode, IMAGE_NODE);
+		break;
+	case NODEIF:
+		c.test = (node *) image_ref(w, IMAGE_FIELD(pos, node, test),
+					    n->test, IMAGE_NODE);
+		c.then = (node *) image_ref(w, IMAGE_FIELD(pos, node, then),
+					    n->then, IMAGE_NODE);
+		c.otherwise = (node *)
+		    image_ref(w, IMAGE_FIELD(pos, node, otherwise),
+			      n->otherwise, IMAGE_NODE);
+		break;
+	case NODEBEGIN:
+		c.body = (node *) image_ref(w, IMAGE_FIELD(pos, node, body),
+					    n->body, IMAGE_NODE);
+		break;
+	case NODECALL:
+	case NODEPCALL:
+		c.args = (node *) image_ref(w, IMAGE_FIELD(pos, node, args),
+					    n->args, IMAGE_NODE);
+		c.argc = n->argc;
+		break;
+	case NODEFUTURE:
+		c.task = (node *) image_ref(w, IMAGE_FIELD(pos, node, task),
+					    n->task, IMAGE_NODE);
+		c.implicit = n->implicit;
+		break;
+	case NODELAMBDA:
+		c.info = (lambdainfo *)
+		    image_ref(w, IMAGE_FIELD(pos, node, info), n->info,
+			      IMAGE_LAMBDA);
+		c.lambdavars = image_value(w, IMAGE_FIELD(pos, node, lambdavars),
+					   n->lambdavars);
+		c.lambdaexpr = image_value(w, IMAGE_FIELD(pos, node, lambdaexpr),
+					   n->lambdaexpr);
+		break;
+	}
+	memcpy(image_at(w, pos), &c, sizeof(c));
+}
+
+static void image_write_env(imagewriter * w, const env * en, uint64_t pos)
+{
+	env c;
+	size_t i;
+
+	memset(&c, 0, sizeof(c));
+	c.count = en->count;
+	c.capacity = en->capacity;
+	c.hashed = en->hashed;
+	c.outer = (env *) image_ref(w, IMAGE_FIELD(pos, env, outer),
+				    en->outer, IMAGE_ENV);
+	if (en->capacity > 0) {
+		uint64_t at = image_alloc_data(w, en->capacity
+					       * sizeof(dictentry *));
+		c.entries = (dictentry **)
+		    image_address(w, IMAGE_FIELD(pos, env, entries), at);
+		for (i = 0; i < en->capacity; i++) {
+			uint64_t slot = at + i * sizeof(dictentry *);
+			uintptr_t d = image_ref(w, slot, en->entries[i],
+						IMAGE_DICT);
+			memcpy(image_at(w, slot), &d, sizeof(d));
+		}
+	}
+	memcpy(image_at(w, pos), &c, sizeof(c));
+}
 
+static void image_write_lambda(imagewriter * w, const lambdainfo * info,
+			       uint64_t pos)
+{
+	lambdainfo c;
+	uint64_t at;
+	int i;
+
+	memset(&c, 0, sizeof(c));
+	c.argc = info->argc;
+	c.nslots = info->nslots;
+	c.nfree = info->nfree;
+	c.body = (node *) image_ref(w, IMAGE_FIELD(pos, lambdainfo, body),
+				    info->body, IMAGE_NODE);
+	image_name(w, IMAGE_FIELD(pos, lambdainfo, name), info->name,
+		   FIXUP_SYMBOL);
+	if (info->nslots > 0) {
+		at = image_alloc_data(w, info->nslots * sizeof(symbol *));
+		c.slots = (symbol **)
+		    image_address(w, IMAGE_FIELD(pos, lambdainfo, slots), at);
+		for (i = 0; i < info->nslots; i++)
+			image_name(w, at + i * sizeof(symbol *),
+				   info->slots[i], FIXUP_SYMBOL);
+	}
+	if (info->nfree > 0) {
+		at = image_alloc_data(w, info->nfree * sizeof(freevar));
+		c.free = (freevar *)
+		    image_address(w, IMAGE_FIELD(pos, lambdainfo, free), at);
+		for (i = 0; i < info->nfree; i++) {
+			freevar f = info->free[i];
+			uint64_t slot = at + i * sizeof(freevar);
+			image_name(w, IMAGE_FIELD(slot, freevar, sym), f.sym,
+				   FIXUP_SYMBOL);
+			f.sym = NULL;
+			memcpy(image_at(w, slot), &f, sizeof(f));
+		}
+	}
+	memcpy(image_at(w, pos), &c, sizeof(c));
+	w->lambdas = image_grow(w->lambdas, w->nlambdas, &w->lambdas_capacity,
+				sizeof(uint64_t));
+	w->lambdas[w->nlambdas++] = pos;
+}
+
+static void image_write_object(imagewriter * w, imageobject o)
+{
+	const dictentry *d = o.obj;
+	const pair *p = o.obj;
+	dictentry dc;
+	pair pc;
+
+	switch (o.kind) {
+	case IMAGE_EXPR:
+		image_write_expr(w, o.obj, o.pos);
+		break;
+	case IMAGE_ENV:
+		image_write_env(w, o.obj, o.pos);
+		break;
+	case IMAGE_DICT:
+		image_name(w, IMAGE_FIELD(o.pos, dictentry, sym), d->sym,
+			   FIXUP_SYMBOL);
+		dc.sym = NULL;
+		dc.value = image_value(w, IMAGE_FIELD(o.pos, dictentry, value),
+				       d->value);
+		memcpy(image_at(w, o.pos), &dc, sizeof(dc));
+		break;
+	case IMAGE_NODE:
+		image_write_node(w, o.obj, o.pos);
+		break;
+	case IMAGE_PAIR:
+		pc.car = image_value(w, IMAGE_FIELD(o.pos, pair, car), p->car);
+		pc.cdr = image_value(w, IMAGE_FIELD(o.pos, pair, cdr), p->cdr);
+		memcpy(image_at(w, o.pos), &pc, sizeof(pc));
+		break;
+	case IMAGE_LAMBDA:
+		image_write_lambda(w, o.obj, o.pos);
+		break;
+	}
+}
+
+/*
+ * Turn the positions into offsets in the area and the relocated words
+ * into addresses of the area at IMAGE_BASE.
+ * Returns:
+ *   the word indices of the relocations.
+ */
+static uint32_t *image_relocate(imagewriter * w)
+{
+	uint32_t *relocs = malloc(w->nrelocs * sizeof(uint32_t) + 1);
+	size_t i;
+
+	if ((w->heap_size + w->data_size) / sizeof(uintptr_t) > UINT32_MAX) {
+		print_err("%s", "The image is too large.\n");
+		exit(-1);
+	}
+	for (i = 0; i < w->nrelocs; i++) {
+		char *at = image_at(w, w->relocs[i].at);
+		uintptr_t word;
+		memcpy(&word, at, sizeof(word));
+		word += IMAGE_BASE + (w->relocs[i].data ? w->heap_size : 0);
+		memcpy(at, &word, sizeof(word));
+		relocs[i] = image_offset(w, w->relocs[i].at) / sizeof(uintptr_t);
+	}
+	for (i = 0; i < w->nfixups; i++)
+		w->fixups[i].at = image_offset(w, w->fixups[i].at);
+	for (i = 0; i < w->nlambdas; i++)
+		w->lambdas[i] = image_offset(w, w->lambdas[i]);
+	return relocs;
+}
+
+/*
+ * (save-image (quote file)); the file name is a symbol. The image is
+ * written to a temporary file which then replaces the file, so that an
+ * interpreter which has mapped the old image keeps its pages.
+ */
+value save_image(interp * ip, int argc, value * argv)
+{
+	check_argc(argc, 1, 1, "save-image");
+	expr *name = value_expr(argv[0]);
+	if (name == NULL || name->type != EXPRSYM) {
+		print_err("%s", "save-image expects a quoted file name.\n");
+		exit(-1);
+	}
+	const char *path = name->symvalue->name;
+	size_t len = strlen(path);
+	char *tmp = malloc(len + sizeof(".tmp"));
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		print_err("Could not open %s.\n", tmp);
+		exit(-1);
+	}
+
+	imagewriter w;
+	imageheader h;
+	size_t i;
+	memset(&w, 0, sizeof(w));
+	memset(&h, 0, sizeof(h));
+	w.ip = ip;
+	for (i = 0; i < NPOOLS; i++)
+		w.slabs[i] = SIZE_MAX;
+	env_lock(ip);
+	uint64_t root = image_position(&w, ip->global_env, IMAGE_ENV);
+	for (i = 0; i < w.nobjects; i++)
+		image_write_object(&w, w.objects[i]);
+	env_unlock(ip);
+	uint32_t *relocs = image_relocate(&w);
+
+	memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+	h.version = IMAGE_VERSION;
+	memcpy(h.layout, image_layout, sizeof(h.layout));
+	h.base = IMAGE_BASE;
+	h.heap_size = w.heap_size;
+	h.data_size = w.data_size;
+	h.global_env = IMAGE_BASE + image_offset(&w, root);
+	h.handlers = (uintptr_t) eval_const;
+	h.nfixups = w.nfixups;
+	h.nlambdas = w.nlambdas;
+	h.nrelocs = w.nrelocs;
+	h.nnames = w.nnames;
+	for (i = 0; i < w.nnames; i++)
+		h.names_size += sizeof(uint32_t) + w.names[i]->len;
+
+	fwrite(&h, sizeof(h), 1, f);
+	fseek(f, SLAB_SIZE, SEEK_SET);
+	fwrite(w.heap, 1, w.heap_size, f);
+	fwrite(w.data, 1, w.data_size, f);
+	fwrite(w.fixups, sizeof(imagefixup), w.nfixups, f);
+	fwrite(w.lambdas, sizeof(uint64_t), w.nlambdas, f);
+	fwrite(relocs, sizeof(uint32_t), w.nrelocs, f);
+	for (i = 0; i < w.nnames; i++) {
+		uint32_t n = w.names[i]->len;
+		fwrite(&n, sizeof(n), 1, f);
+		fwrite(w.names[i]->name, 1, n, f);
+	}
+	bool failed = ferror(f) != 0;
+	if (fclose(f) != 0 || failed || rename(tmp, path) != 0) {
+		print_err("Could not write %s.\n", path);
+		exit(-1);
+	}
+	free(tmp);
+	free(relocs);
+	free(w.heap);
+	free(w.data);
+	free(w.keys);
+	free(w.positions);
+	free(w.objects);
+	free(w.relocs);
+	free(w.fixups);
+	free(w.lambdas);
+	free(w.names);
+	return VAL_EMPTY;
+}
+
+/* The handler of every node type, for the nodes of an image. */
+static value(*const node_handlers[NNODETYPES]) (interp *, node **, env **) = {
+	[NODECONST] = eval_const,[NODELOCAL] = eval_local,
+	[NODEGLOBAL] = eval_global,[NODELAMBDA] = eval_lambda,
+	[NODEDEFINE] = eval_define,[NODESET] = eval_define,
+	[NODEIF] = eval_if,[NODEBEGIN] = eval_begin,
+	[NODECALL] = eval_call,[NODEFUTURE] = eval_future,
+	[NODEPCALL] = eval_call
+};
+
+static native *find_native(interp * ip, symbol * name)
+{
+	size_t i;
+	for (i = 0; i < ip->nnatives; i++) {
+		if (ip->natives[i].name == name)
+			return &ip->natives[i];
+	}
 	return NULL;
 }
 
 /*
- * Return the length of an expression list.
- * Params:
- *   e : An expr struct pointer. This should be an expression list.
- * Returns:
- *   the length of the list or -1 if e is not an expression list.
+ * Check that the sections of an image lie within a file of `size'
+ * bytes and that it was written for this layout.
+ */
+static bool image_header_ok(const imageheader * h, uint64_t size)
+{
+	uint64_t left = size;
+
+	if (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0
+	    || h->version != IMAGE_VERSION
+	    || memcmp(h->layout, image_layout, sizeof(h->layout)) != 0)
+		return false;
+	if (left < SLAB_SIZE || h->heap_size % SLAB_SIZE != 0
+	    || h->data_size % 8 != 0 || h->base % SLAB_SIZE != 0
+	    || h->base < SLAB_SIZE)
+		return false;
+	left -= SLAB_SIZE;
+	if (h->heap_size > left || h->data_size > left - h->heap_size)
+		return false;
+	left -= h->heap_size + h->data_size;
+	if (h->base > UINTPTR_MAX - h->heap_size - h->data_size)
+		return false;
+	if (h->nfixups > left / sizeof(imagefixup))
+		return false;
+	left -= h->nfixups * sizeof(imagefixup);
+	if (h->nlambdas > left / sizeof(uint64_t))
+		return false;
+	left -= h->nlambdas * sizeof(uint64_t);
+	if (h->nrelocs > left / sizeof(uint32_t))
+		return false;
+	left -= h->nrelocs * sizeof(uint32_t);
+	if (h->names_size > left || h->nnames > h->names_size)
+		return false;
+	return h->global_env >= h->base
+	    && h->global_env - h->base < h->heap_size
+	    && h->global_env % sizeof(void *) == 0;
+}
+
+/*
+ * Map an image file at the address its area was written for or, if
+ * that is taken, at another one which is SLAB_SIZE aligned. The length
+ * is rounded up to SLAB_SIZE.
+ * Returns:
+ *   the mapping or NULL.
+ */
+static char *image_map(int fd, size_t len, uintptr_t want)
+{
+	char *map = mmap((void *)want, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+	if (map == (char *)want)
+		return map;
+	if (map != MAP_FAILED)
+		munmap(map, len);
+
+	char *reserved = mmap(NULL, len + SLAB_SIZE, PROT_NONE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (reserved == MAP_FAILED)
+		return NULL;
+	char *aligned = (char *)(((uintptr_t) reserved + SLAB_SIZE - 1)
+				 & ~(uintptr_t) (SLAB_SIZE - 1));
+	map = mmap(aligned, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_FIXED, fd, 0);
+	if (map == MAP_FAILED) {
+		munmap(reserved, len + SLAB_SIZE);
+		return NULL;
+	}
+	/* Release what is left of the reservation. */
+	if (aligned > reserved)
+		munmap(reserved, aligned - reserved);
+	if (reserved + SLAB_SIZE > aligned)
+		munmap(aligned + len, reserved + SLAB_SIZE - aligned);
+	return map;
+}
+
+/*
+ * Check the slabs of an image: their pool ids and object counts, and
+ * the node types, which select the handlers.
+ */
+static bool image_check_slabs(interp * ip, char *area, size_t heap_size)
+{
+	size_t at, i;
+
+	for (at = 0; at < heap_size; at += SLAB_SIZE) {
+		slab *sl = (slab *) (area + at);
+		uintptr_t id = (uintptr_t) sl->pool;
+		if (id >= NPOOLS || sl->nobjects > (SLAB_SIZE - SLAB_HEADER_SIZE)
+		    / ip->pools[id]->objsize)
+			return false;
+		if (ip->pools[id] != &ip->node_pool)
+			continue;
+		for (i = 0; i < sl->nobjects; i++) {
+			node *n = (node *) (area + at + SLAB_HEADER_SIZE
+					    + i * ip->node_pool.objsize);
+			if ((unsigned)n->type >= NNODETYPES)
+				return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Intern the names of an image.
+ * Returns:
+ *   the symbols by index or NULL if the table is corrupt.
+ */
+static symbol **image_read_names(interp * ip, const char *names,
+				 const imageheader * h)
+{
+	symbol **syms = malloc(h->nnames * sizeof(symbol *) + 1);
+	size_t at = 0, i;
+	uint32_t len;
+
+	for (i = 0; i < h->nnames; i++) {
+		if (h->names_size - at < sizeof(len))
+			break;
+		memcpy(&len, names + at, sizeof(len));
+		at += sizeof(len);
+		if (len > h->names_size - at)
+			break;
+		syms[i] = intern_n(ip, names + at, len);
+		at += len;
+	}
+	if (i < h->nnames) {
+		free(syms);
+		return NULL;
+	}
+	return syms;
+}
+
+/*
+ * Check that the fixups of an image refer to words in its area and to
+ * names which this interpreter knows. Prints the unknown procedures.
+ */
+static bool image_check_fixups(interp * ip, const imagefixup * fixups,
+			       const imageheader * h, symbol ** syms)
+{
+	uint64_t area_size = h->heap_size + h->data_size;
+	size_t i, j;
+
+	for (i = 0; i < h->nfixups; i++) {
+		const imagefixup *f = &fixups[i];
+		size_t size = f->kind == FIXUP_SYMBOL ? sizeof(void *)
+		    : sizeof(expr);
+		if (f->kind > FIXUP_NATIVE || f->name >= h->nnames
+		    || f->at % sizeof(void *) != 0 || f->at > area_size - size)
+			return false;
+		if (f->kind == FIXUP_PROC) {
+			for (j = 0; j < NBUILTINS; j++) {
+				if (strcmp(builtins[j].name,
+					   syms[f->name]->name) == 0)
+					break;
+			}
+			if (j == NBUILTINS) {
+				print_err("Unknown procedure %s in the image.\n",
+					  syms[f->name]->name);
+				return false;
+			}
+		} else if (f->kind == FIXUP_NATIVE
+			   && find_native(ip, syms[f->name]) == NULL) {
+			print_err("Native procedure %s is not registered.\n",
+				  syms[f->name]->name);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void image_fixup(interp * ip, char *area, const imagefixup * f,
+			symbol ** syms)
+{
+	symbol *s = syms[f->name];
+	expr *e = (expr *) (area + f->at);
+	native *n;
+	size_t j;
+
+	switch (f->kind) {
+	case FIXUP_SYMBOL:
+		memcpy(area + f->at, &s, sizeof(s));
+		break;
+	case FIXUP_SYMEXPR:
+		e->symvalue = s;
+		if (s->expr == NULL)
+			s->expr = e;
+		break;
+	case FIXUP_PROC:
+		for (j = 0; strcmp(builtins[j].name, s->name) != 0; j++) ;
+		e->proc = builtins[j].proc;
+		break;
+	case FIXUP_NATIVE:
+		n = find_native(ip, s);
+		e->native = n->proc;
+		e->arity = n->arity;
+		e->data = n->data;
+		e->nativename = n->name;
+		break;
+	}
+}
+
+/*
+ * Link the slabs of an image into the pools and register its lambdas.
+ * Node handlers are set here if the executable has moved.
+ */
+static void image_link(interp * ip, char *area, const imageheader * h,
+		       const uint64_t * lambdas)
+{
+	size_t at, i;
+
+	heap_lock(ip);
+	for (at = 0; at < h->heap_size; at += SLAB_SIZE) {
+		slab *sl = (slab *) (area + at);
+		pool *p = ip->pools[(uintptr_t) sl->pool];
+		sl->pool = p;
+		sl->objects = (char *)sl + SLAB_HEADER_SIZE;
+		sl->young = false;
+		memset(sl->marks, 0, sizeof(sl->marks));
+		memset(sl->remembered, 0, sizeof(sl->remembered));
+		if (p == &ip->node_pool
+		    && h->handlers != (uintptr_t) eval_const) {
+			for (i = 0; i < sl->nobjects; i++) {
+				node *n = (node *) (sl->objects
+						    + i * p->objsize);
+				n->eval = node_handlers[n->type];
+			}
+		}
+		sl->next = p->slabs;
+		p->slabs = sl;
+		p->nobjects += sl->nobjects;
+		ip->gc_heap_bytes += sl->nobjects * p->objsize;
+	}
+	/* The image is not garbage, so it does not count as growth. */
+	if (ip->gc_threshold < ip->gc_heap_bytes * ip->gc_growth)
+		ip->gc_threshold = ip->gc_heap_bytes * ip->gc_growth;
+	heap_unlock(ip);
+	for (i = 0; i < h->nlambdas; i++)
+		gc_add_lambda(ip, (lambdainfo *) (area + lambdas[i]));
+}
+
+/*
+ * Use an image which has been mapped at `map' and make its global
+ * environment the global environment of the interpreter. Builtins and
+ * registered native procedures which the image does not bind are added
+ * to it.
+ * Returns:
+ *   false if the image is corrupt; then nothing refers to the mapping.
+ */
+static bool image_load(interp * ip, char *map, size_t len,
+		       const imageheader * h)
+{
+	char *area = map + SLAB_SIZE;
+	uint64_t area_size = h->heap_size + h->data_size;
+	const imagefixup *fixups = (const imagefixup *)(area + area_size);
+	const uint64_t *lambdas = (const uint64_t *)(fixups + h->nfixups);
+	const uint32_t *relocs = (const uint32_t *)(lambdas + h->nlambdas);
+	const char *names = (const char *)(relocs + h->nrelocs);
+	uintptr_t delta = (uintptr_t) area - h->base;
+	uintptr_t *words = (uintptr_t *) area;
+	symbol **syms;
+	size_t i;
+
+	if (!image_check_slabs(ip, area, h->heap_size))
+		return false;
+	for (i = 0; i < h->nlambdas; i++) {
+		if (lambdas[i] % sizeof(void *) != 0
+		    || lambdas[i] > area_size - sizeof(lambdainfo))
+			return false;
+	}
+	if ((syms = image_read_names(ip, names, h)) == NULL)
+		return false;
+	if (!image_check_fixups(ip, fixups, h, syms)) {
+		free(syms);
+		return false;
+	}
+	if (delta != 0) {
+		for (i = 0; i < h->nrelocs; i++) {
+			if (relocs[i] >= area_size / sizeof(uintptr_t)) {
+				free(syms);
+				return false;
+			}
+			words[relocs[i]] += delta;
+		}
+	}
+
+	/* From here on, the image is in use. */
+	for (i = 0; i < h->nfixups; i++)
+		image_fixup(ip, area, &fixups[i], syms);
+	free(syms);
+	ip->images = realloc(ip->images, (ip->nimages + 1) * sizeof(imagemap));
+	ip->images[ip->nimages].map = map;
+	ip->images[ip->nimages].len = len;
+	ip->images[ip->nimages].area = area;
+	ip->images[ip->nimages].area_size = area_size;
+	ip->nimages++;
+	image_link(ip, area, h, lambdas);
+
+	env *en = (env *) (uintptr_t) (h->global_env + delta);
+	ip->global_env = en;
+	ip->global_version++;
+	for (i = 0; i < NBUILTINS; i++) {
+		symbol *s = intern(ip, builtins[i].name);
+		dictentry *d = env_lookup(ip, en, s);
+		if (d == NULL || d->value == NULL)
+			add_to_env(ip, en, s, (value)
+				   create_exprproc(ip, builtins[i].proc), false);
+	}
+	for (i = 0; i < ip->nnatives; i++) {
+		dictentry *d = env_lookup(ip, en, ip->natives[i].name);
+		if (d == NULL || d->value == NULL)
+			add_to_env(ip, en, ip->natives[i].name, (value)
+				   create_exprnative(ip, &ip->natives[i]),
+				   false);
+	}
+	return true;
+}
+
+/*
+ * Start an interpreter with the global environment of an image, see
+ * save_image. The interpreter must not be evaluating at the same time.
+ * The image stays mapped until the interpreter is freed.
+ * Returns:
+ *   false if the file could not be loaded.
+ */
+bool load_image(interp * ip, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	struct stat st;
+	imageheader h;
+	char *map = NULL;
+	size_t len = 0;
+
+	if (f == NULL) {
+		print_err("Could not open %s.\n", path);
+		return false;
+	}
+	if (fstat(fileno(f), &st) != 0 || fread(&h, sizeof(h), 1, f) != 1
+	    || !image_header_ok(&h, st.st_size)) {
+		print_err("%s is not an image of this interpreter.\n", path);
+		fclose(f);
+		return false;
+	}
+	len = ((size_t)st.st_size + SLAB_SIZE - 1) & ~(size_t) (SLAB_SIZE - 1);
+	map = image_map(fileno(f), len, h.base - SLAB_SIZE);
+	fclose(f);
+	if (map == NULL) {
+		print_err("Could not map %s.\n", path);
+		return false;
+	}
+
+	worker *prev = interp_enter(ip);
+	bool ok = image_load(ip, map, len, &h);
+	interp_leave(prev);
+	if (!ok) {
+		munmap(map, len);
+		print_err("Could not load the image %s.\n", path);
+	}
+	return ok;
+}
+
+/*
+ * Create an interpreter with the global procedures. A thread which has
+ * not run an interpreter yet becomes its main thread, see interp_enter.
+ * It has no thread pool until worker_count is set.
+ */
+interp *interp_new()
+{
+	interp *ip = calloc(1, sizeof(interp));
+	pthread_mutexattr_t attr;
+	size_t i;
+
+	ip->pools[0] = &ip->expr_pool;
+	ip->pools[1] = &ip->env_pool;
+	ip->pools[2] = &ip->dict_pool;
+	ip->pools[3] = &ip->node_pool;
+	ip->pools[4] = &ip->pair_pool;
+	for (i = 0; i < NPOOLS; i++)
+		*ip->pools[i] = pool_types[i];
+	ip->global_version = 1;
+	ip->gc_nursery_size = 1024 * 1024;
+	ip->gc_threshold = 1024 * 1024;
+	ip->gc_min_heap = 1024 * 1024;
+	ip->gc_growth = 2.0;
+
+	ip->main_worker.running = true;
+	ip->main_worker.ip = ip;
+	ip->workers[0] = &ip->main_worker;
+	ip->nworkers = 1;
+	ip->worker_count = 1;
+	ip->task_grain = 4;
+	pthread_mutex_init(&ip->heap_mutex, NULL);
+	pthread_cond_init(&ip->gc_parked_cond, NULL);
+	pthread_cond_init(&ip->gc_done_cond, NULL);
+	pthread_cond_init(&ip->work_cond, NULL);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&ip->env_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	worker *prev = interp_enter(ip);
+	init_symbols(ip);
+	ip->global_env = create_env(ip, NULL, 0);
+	init_global(ip, ip->global_env);
+	interp_leave(prev);
+	return ip;
+}
+
+/* Free the slabs of a list; those of images are unmapped later. */
+static void slabs_free(interp * ip, slab * sl)
+{
+	slab *next;
+	for (; sl != NULL; sl = next) {
+		next = sl->next;
+		if (!image_contains(ip, sl))
+			free(sl);
+	}
+}
+
+/*
+ * Free an interpreter: stop its worker threads and release its heap,
+ * its symbols and its code. Futures which have not run are dropped.
+ */
+void interp_free(interp * ip)
+{
+	worker *prev = interp_enter(ip);
+	symbol *s, *next;
+	lambdainfo *info;
+	size_t i;
+
+	if (ip->threaded) {
+		pthread_mutex_lock(&ip->heap_mutex);
+		__atomic_store_n(&ip->closing, true, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&ip->work_cond);
+		pthread_mutex_unlock(&ip->heap_mutex);
+		/* The workers may collect until they are done. */
+		gc_block(ip);
+		for (i = 1; i < ip->nworkers; i++)
+			pthread_join(ip->workers[i]->thread, NULL);
+	}
+
+	/* Finalize every object, then release the slabs. */
+	nursery_retire(ip);
+	for (i = 0; i < NPOOLS; i++) {
+		nursery_reset(ip, ip->pools[i]);
+		pool_sweep(ip, ip->pools[i]);
+		slabs_free(ip, ip->pools[i]->slabs);
+	}
+	slabs_free(ip, ip->free_slabs);
+
+	for (i = 0; i < ip->symtab_size; i++) {
+		for (s = ip->symtab[i]; s != NULL; s = next) {
+			next = s->next;
+			free(s->name);
+			free(s);
+		}
+	}
+	free(ip->symtab);
+	for (i = 0; i < ip->nlambdas; i++) {
+		info = ip->lambdas[i];
+		if (image_contains(ip, info))
+			continue;
+		free(info->slots);
+		free(info->free);
+		free(info);
+	}
+	free(ip->lambdas);
+	while (ip->ncodes > 0)
+		code_free(ip, ip->codes[ip->ncodes - 1]);
+	free(ip->codes);
+	for (i = 0; i < ip->nimages; i++)
+		munmap(ip->images[i].map, ip->images[i].len);
+	free(ip->images);
+	free(ip->gc_remembered);
+	free(ip->gc_gray);
+	free(ip->natives);
+
+	for (i = 0; i < ip->nworkers; i++) {
+		free(ip->workers[i]->roots);
+		free(ip->workers[i]->vstack);
+		if (i > 0)
+			free(ip->workers[i]);
+	}
+	pthread_mutex_destroy(&ip->heap_mutex);
+	pthread_mutex_destroy(&ip->env_mutex);
+	pthread_cond_destroy(&ip->gc_parked_cond);
+	pthread_cond_destroy(&ip->gc_done_cond);
+	pthread_cond_destroy(&ip->work_cond);
+	self = prev != NULL && prev->ip != ip ? prev : NULL;
+	free(ip);
+}
+
+/**        EMBEDDING: **/
+
+/*
+ * The interface of libminiclisp, see miniclisp.h. Like eval_toplevel,
+ * every function binds the calling thread to the interpreter first, so
+ * a program may use several interpreters; only one thread at a time may
+ * call into each of them. The only other thread which may call in is a
+ * worker of the interpreter, from a native procedure.
+ */
+
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+static void simd_init_best()
+{
+	simd_init(NULL);
+}
+
+miniclisp *miniclisp_new(void)
+{
+	pthread_once(&simd_once, simd_init_best);
+	return interp_new();
+}
+
+/* Free an interpreter; the output it has buffered is written first. */
+void miniclisp_free(miniclisp * ip)
+{
+	out_flush();
+	interp_free(ip);
+}
+
+/*
+ * Bind a global variable to a procedure of the embedding program. The
+ * procedure is registered under its name, which is how images refer to
+ * it; defining a name again replaces it.
+ * Params:
+ *   arity : the number of arguments, or MINICLISP_VARIADIC; calls with
+ *           another number of arguments fail.
+ *   data : passed to every call of proc.
+ */
+void miniclisp_define_native(miniclisp * ip, const char *name,
+			     miniclisp_native proc, int arity, void *data)
+{
+	worker *prev = interp_enter(ip);
+	native n = { intern(ip, name), proc, arity, data };
+	native *registered = find_native(ip, n.name);
+
+	if (registered == NULL) {
+		if (ip->nnatives == ip->natives_capacity) {
+			ip->natives_capacity = ip->natives_capacity == 0
+			    ? 16 : ip->natives_capacity * 2;
+			ip->natives = realloc(ip->natives,
+					      ip->natives_capacity *
+					      sizeof(native));
+		}
+		registered = &ip->natives[ip->nnatives++];
+	}
+	*registered = n;
+	expr *e = create_exprnative(ip, registered);
+	add_to_env(ip, ip->global_env, n.name, (value) e, false);
+	interp_leave(prev);
+}
+
+void miniclisp_define(miniclisp * ip, const char *name, miniclisp_value v)
+{
+	worker *prev = interp_enter(ip);
+	add_to_env(ip, ip->global_env, intern(ip, name), v, false);
+	interp_leave(prev);
+}
+
+/*
+ * Returns:
+ *   the value of a global variable or NULL if it is not defined.
+ */
+miniclisp_value miniclisp_lookup(miniclisp * ip, const char *name)
+{
+	worker *prev = interp_enter(ip);
+	dictentry *d = env_lookup(ip, ip->global_env, intern(ip, name));
+	interp_leave(prev);
+	return d != NULL ? d->value : NULL;
+}
+
+/*
+ * Read the next form of a string. The form can be evaluated any number
+ * of times, but it has to be registered with miniclisp_root to survive
+ * another call into the interpreter.
+ * Params:
+ *   s : the string; it is advanced behind the form.
+ * Returns:
+ *   the form or NULL at the end of the string.
+ */
+miniclisp_value miniclisp_read(miniclisp * ip, const char **s)
+{
+	reader r = { NULL, (char *)*s, 0, strlen(*s), 0, 0, false };
+	value form = read_expr(ip, &r);
+	*s += r.pos;
+	return form;
+}
+
+/*
+ * Replace the global environment by the one of an image. The native
+ * procedures it refers to have to be defined before.
  */
-int get_list_size(expr * e)
+bool miniclisp_load_image(miniclisp * ip, const char *path)
 {
-	if (e == NULL) {
-		print_err("%s", "Argument e is NULL.\n");
-		return -1;
-	}
-	if (e->type != EXPRLIST) {
-		print_err("%s", "Argument e is not an expression list.\n");
-		return -1;
-	}
-	int counter = 0;
-	expr *current_list_entry = e->listptr;
-	while (current_list_entry != NULL) {
-		current_list_entry = current_list_entry->next;
-		counter++;
-	}
-	return counter;
+	return load_image(ip, path);
 }
 
-void _print_expr(expr * e, bool verbose)
+/* Evaluate a form in the global environment. */
+miniclisp_value miniclisp_eval(miniclisp * ip, miniclisp_value form)
 {
-	if (e == NULL) {
-		print_err("%s", "Argument e is NULL.");
-	} else if (e->type == EXPRLIST) {
-		printf("%s", verbose ? " EXPRLIST[" : "(");
-		expr *t = e->listptr;
-		while (t != NULL) {
-			_print_expr(t, verbose);
-			t = t->next;
-		}
-		printf("%s", verbose ? "] " : ")");
-	} else if (e->type == EXPREMPTY) {
-		printf("%s", verbose ? "()" : " [] ");
-	} else if (e->type == EXPRINT) {
-		if (verbose)
-			printf(" INT: %lld ", e->intvalue);
+	return eval_toplevel(ip, form, ip->global_env);
+}
+
+/*
+ * Call a procedure, e.g. a closure which a form returned. The arguments
+ * are not copied into a list: a native procedure or builtin gets argv
+ * itself, and the frame of a closure is filled from it.
+ */
+miniclisp_value miniclisp_call(miniclisp * ip, miniclisp_value proc,
+			       int argc, miniclisp_value * argv)
+{
+	worker *prev = interp_enter(ip);
+	expr *fn = value_expr(proc);
+	value res;
+
+	if (is_proc(fn)) {
+		res = call_proc(ip, fn, argc, argv);
+	} else if (fn != NULL && fn->type == EXPRLAMBDA) {
+		lambdainfo *info = fn->lambdainfo;
+		if (info->argc != argc) {
+			print_err
+			    ("Wrong number of arguments for lambda %d required: %d\n",
+			     info->argc, argc);
+			exit(-1);
+		}
+		self->counters.applications++;
+		env *frame = create_lambda_env(ip, fn->lambdaenv, info, argv);
+		if (ip->use_tree_walker)
+			res = eval_node(ip, info->body, frame);
 		else
-			printf("%lld", e->intvalue);
-	} else if (e->type == EXPRPROC) {
-		printf(" PROC: %p ", e->proc);
-	} else if (e->type == EXPRLAMBDA) {
-		printf("[LAMBDA EXPR ARGS:");
-		_print_expr(e->lambdavars, verbose);
-		printf(" BODY ");
-		_print_expr(e->lambdaexpr, verbose);
-		printf("]");
+			res = vm_run(ip, lambda_code(ip, info), frame);
 	} else {
-		printf(" SYM:'%s' ", e->symvalue);
+		print_err("%s", "Could not call a non-procedure\n");
+		exit(-1);
 	}
+	interp_leave(prev);
+	return res;
 }
 
-void print_expr(expr * e)
+/*
+ * The values which the embedding program keeps are roots on the shadow
+ * stack, like the variables of eval:
+ *   size_t roots = miniclisp_roots_save(ip);
+ *   miniclisp_root(ip, &v);
+ *   ...
+ *   miniclisp_roots_restore(ip, roots);
+ */
+size_t miniclisp_roots_save(miniclisp * ip)
 {
-	_print_expr(e, true);
-	printf("\n");
+	worker *prev = interp_enter(ip);
+	size_t roots = gc_roots_save();
+	interp_leave(prev);
+	return roots;
 }
 
-void quote_expr(expr * e)
+void miniclisp_root(miniclisp * ip, miniclisp_value * ref)
 {
-	_print_expr(e, false);
-	printf("\n");
+	worker *prev = interp_enter(ip);
+	gc_root_value(ref);
+	interp_leave(prev);
 }
 
-void print_expr_debug(expr * e)
+void miniclisp_roots_restore(miniclisp * ip, size_t roots)
 {
-	if (DEBUG)
-		print_expr(e);
+	worker *prev = interp_enter(ip);
+	gc_roots_restore(roots);
+	interp_leave(prev);
 }
 
-void add_to_exprlist(expr * list, expr * new)
+miniclisp_value miniclisp_int(miniclisp * ip, long long int i)
 {
-	if (list == 0)
-		return;
-	else if (list->listptr == 0)
-		list->listptr = new;
-	else {
-		expr *t = list->listptr;
-		while (t->next != 0) {
-			t = t->next;
-		}
-		t->next = new;
-	}
+	worker *prev = interp_enter(ip);
+	value v = make_int(ip, i);
+	interp_leave(prev);
+	return v;
 }
 
-static env *create_env(env * outer, dictentry * list)
+bool miniclisp_is_int(miniclisp_value v)
 {
-	env *new = malloc(sizeof(env));
-	new->outer = outer;
-	new->list = list;
-
-	gc_collect_env(new);
-
-	return new;
+	return is_int(v);
 }
 
-static expr *create_expr(enum exprtype type)
+long long int miniclisp_get_int(miniclisp_value v)
 {
-	expr *new = malloc(sizeof(expr));
-	new->type = type;
-	new->next = NULL;
-	memset(new->symvalue, 0, sizeof(new->symvalue));
-
-	gc_collect_expr(new);
-
-	return new;
+	return get_int(v);
 }
 
-static expr *create_exprempty()
+miniclisp_value miniclisp_cons(miniclisp * ip, miniclisp_value car,
+			       miniclisp_value cdr)
 {
-	return create_expr(EXPREMPTY);
+	worker *prev = interp_enter(ip);
+	value v = cons(ip, car, cdr);
+	interp_leave(prev);
+	return v;
 }
 
-static expr *create_exprproc(struct expr *(*proc) (struct expr *))
+bool miniclisp_is_pair(miniclisp_value v)
 {
-	expr *new = create_expr(EXPRPROC);
-	new->proc = proc;
-
-	return new;
+	return is_pair(v);
 }
 
-expr *create_exprsym(const char *s)
+miniclisp_value miniclisp_car(miniclisp_value v)
 {
-	expr *new = create_expr(EXPRSYM);
+	return value_pair(v)->car;
+}
 
-	strncat(new->symvalue, s, MAXTOKENLEN);
+miniclisp_value miniclisp_cdr(miniclisp_value v)
+{
+	return value_pair(v)->cdr;
+}
 
-	return new;
+value test(interp * ip, char *str, env * en)
+{
+	return eval_toplevel(ip, read(ip, &str), en);
 }
 
-expr *create_exprint(long long int i)
+/* The number of failed tests. */
+static int tests_failed;
+
+bool test_int(interp * ip, char *str, long long int intvalue, env * en)
 {
-	expr *new = create_expr(EXPRINT);
-	new->intvalue = i;
 
-	return new;
+	char *tmp = str;
+	value retval = test(ip, str, en);
+	if (is_int(retval) && get_int(retval) == intvalue) {
+		debug_info("Success. %s == %lld\n\n", tmp, intvalue);
+		return true;
+	}
+	print_err("Test failed for %s : %lld. Result: ", tmp, intvalue);
+	print_value(retval);
+	tests_failed++;
+	return false;
 }
 
-expr *deep_copy(expr * e)
+/*
+ * Check that consecutive heap objects keep the tag bits of their values
+ * clear; see POOL_OBJSIZE. Allocation never collects, so nothing needs
+ * a root here.
+ */
+static bool test_tags(interp * ip)
 {
-	if (e == NULL)
-		return NULL;
-
-	expr *new = create_expr(EXPRSYM);
-	memcpy(new, e, sizeof(expr));
+	int i;
 
-	if (new->type != EXPRLIST)
-		return new;
+	for (i = 0; i < 64; i++) {
+		expr *e = create_exprint(ip, i);
+		value p = cons(ip, make_fixnum(i), VAL_EMPTY);
+		if (((uintptr_t) e & (POOL_ALIGN - 1)) != 0
+		    || value_expr((value) e) != e || is_pair((value) e)
+		    || !is_pair(p) || fixnum_value(value_pair(p)->car) != i)
+			return false;
+	}
+	return true;
+}
 
-	expr *listptr_orig = e->listptr;
+/*
+ * A benchmark workload: the setup is evaluated once, then the operation
+ * is evaluated `iterations' times.
+ */
+typedef struct workload {
+	const char *name;
+	const char *setup;
+	const char *op;
+	long iterations;
+} workload;
 
-	new->listptr = deep_copy(listptr_orig);
-	expr *listptr_new = new->listptr;
+static const workload workloads[] = {
+	{"fib",
+	 "(define fib (lambda (n) (if (< n 2) n"
+	 " (+ (fib (+ n -1)) (fib (+ n -2))))))",
+	 "(fib 20)", 20},
+	{"fact",
+	 "(define fact (lambda (n) (if (< n 2) 1 (* n (fact (+ n -1))))))",
+	 "(fact 12)", 100000},
+	{"ackermann",
+	 "(define ack (lambda (m n) (if (< m 1) (+ n 1)"
+	 " (if (< n 1) (ack (+ m -1) 1) (ack (+ m -1) (ack m (+ n -1)))))))",
+	 "(ack 2 9)", 500},
+	{"tak",
+	 "(define tak (lambda (x y z) (if (< y x)"
+	 " (tak (tak (+ x -1) y z) (tak (+ y -1) z x) (tak (+ z -1) x y))"
+	 " z)))",
+	 "(tak 12 8 4)", 20},
+	/* Nested frames with internal defines, looked up from the inside. */
+	{"defines",
+	 "(define deep (lambda (n)"
+	 " (define a n) (define b (+ a 1)) (define c (+ b 1))"
+	 " ((lambda () (define d (+ c 1)) (define e (+ d a))"
+	 " ((lambda () (define f (+ e b)) (define g (+ f c))"
+	 " (if (< n 1) g (deep (+ n -1)))))))))",
+	 "(deep 100)", 2000},
+	{"list",
+	 "(define build (lambda (n l) (if (< n 1) l"
+	 " (build (+ n -1) (cons n l)))))"
+	 "(define len (lambda (l n) (if (null? l) n (len (cdr l) (+ n 1)))))",
+	 "(len (build 1000 '()) 0)", 200},
+};
 
-	while ((listptr_orig = listptr_orig->next) != NULL) {
-		listptr_new->next = deep_copy(listptr_orig);
-		listptr_new = listptr_new->next;
+/* Evaluate all expressions of a string at the top level. */
+static value eval_string(interp * ip, const char *s)
+{
+	char *p = (char *)s;
+	value res = VAL_EMPTY;
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\n')
+			p++;
+		if (*p == '\0')
+			break;
+		res = eval_toplevel(ip, read(ip, &p), ip->global_env);
 	}
+	return res;
+}
 
-	return new;
+/* The number of exprs, envs and pairs allocated so far. */
+static size_t bench_allocations(interp * ip)
+{
+	return pool_allocations(ip, &ip->expr_pool)
+	    + pool_allocations(ip, &ip->env_pool)
+	    + pool_allocations(ip, &ip->pair_pool);
 }
 
 /*
- * Add a key-value pair to an environment.
- * Params:
- *   env : An environment struct pointer. Must be non-NULL.
- *   sym : New key to be inserted. Must be non-NULL.
- *   value : Value to be inserted/updated. Must be non-NULL.
- *   set : true if value should be set globally.
- * Returns:
- *   The updated dict entry or NULL if there was an error.
+ * Run the benchmark workloads on both engines and print one CSV line
+ * for each: the time and the number of allocated exprs, envs and pairs
+ * per operation, the peak RSS of the process so far and the time spent in
+ * the GC.
  */
-dictentry *add_to_env(env * env, expr * sym, expr * value, bool set)
+void run_bench(interp * ip)
 {
-	if (env == NULL || sym == NULL || value == NULL)
-		return NULL;
+	const bool engines[] = { false, true };
+	size_t i, j;
 
-	dictentry *current_dict_entry = env->list;
+	out_str("workload,engine,iterations,ns_per_op,allocs_per_op,"
+		"peak_rss_kb,gc_ms\n");
+	for (j = 0; j < sizeof(engines) / sizeof(engines[0]); j++) {
+		ip->use_tree_walker = engines[j];
+		for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+			const workload *w = &workloads[i];
+			char *p = (char *)w->op;
+			size_t roots = gc_roots_save();
+			value op = read(ip, &p);
+			long n;
 
-	/* Add new list head if the dictionary is emtpy. */
-	if (current_dict_entry == NULL) {
-		if (env->outer == NULL && set) {
-			print_err("Error. Variable '%s' not defined.\n",
-				  sym->symvalue);
-			return NULL;
-		} else if (set) {
-			return add_to_env(env->outer, sym, value, set);
-		}
-		current_dict_entry = malloc(sizeof(dictentry));
-		current_dict_entry->sym = sym;
-		current_dict_entry->value = value;
-		current_dict_entry->next = NULL;
-		env->list = current_dict_entry;
-		return current_dict_entry;
-	}
-
-	/* Search dictionary for the last entry or an existing key. */
-	while (current_dict_entry->next != NULL) {
-		/* Break if an exising key was found. */
-		if (current_dict_entry->next->sym->type == EXPRSYM
-		    && strcmp(current_dict_entry->next->sym->symvalue,
-			      sym->symvalue) == 0) {
-			break;
-		}
-		current_dict_entry = current_dict_entry->next;
-	}
+			gc_root_value(&op);
+			eval_string(ip, w->setup);
+			gc_major(ip, NULL);
 
-	/* Add new last entry. */
-	if (current_dict_entry->next == NULL) {
-		if (env->outer != NULL && set) {
-			return add_to_env(env->outer, sym, value, set);
-		} else if (set) {
-			print_err("Variable '%s' not defined.\n",
-				  sym->symvalue);
-			return NULL;
+			size_t allocations = bench_allocations(ip);
+			size_t gc_start = ip->gc_counters.gc_ns;
+			double start = clock_seconds();
+			for (n = 0; n < w->iterations; n++)
+				eval_toplevel(ip, op, ip->global_env);
+			double s = clock_seconds() - start;
+
+			struct rusage ru;
+			getrusage(RUSAGE_SELF, &ru);
+			out_printf("%s,%s,%ld,%.1f,%.1f,%ld,%.3f\n", w->name,
+				   ip->use_tree_walker ? "tree" : "vm",
+				   w->iterations, s * 1e9 / w->iterations,
+				   (double)(bench_allocations(ip) -
+					    allocations) / w->iterations,
+				   ru.ru_maxrss,
+				   (ip->gc_counters.gc_ns - gc_start) / 1e6);
+			gc_roots_restore(roots);
 		}
-		current_dict_entry->next = malloc(sizeof(dictentry));
-		current_dict_entry->next->next = NULL;
 	}
-
-	/* Update new entry. */
-	current_dict_entry->next->sym = sym;
-	current_dict_entry->next->value = value;
-
-	return current_dict_entry->next;
 }
 
-expr *eval(expr *, env *);
+/* A job of run_interps: a program which runs in an interpreter of its own. */
+typedef struct interp_job {
+	pthread_t thread;
+	int rounds;
+	bool tree_walker;
+	bool failed;
+} interp_job;
 
-expr *evalList(expr * e, env * en)
+static void *interp_job_main(void *arg)
 {
-	if (e->type != EXPRLIST) {
-		print_err("%s", "Argument e is not a list.\n");
-		exit(-1);
-	}
-	expr *te = e->listptr;
-	expr *prev = NULL;
-	while (te != 0) {
-		expr *savednext = te->next;
-		te = eval(te, en);
-		if (te == NULL) {
-			debug_info("%s", "Removing empty entry from list.\n");
-		} else {
-			if (prev == NULL) {
-				e->listptr = te;
-			} else {
-				prev->next = te;
-				te->next = 0;
-			}
-			prev = te;
-			te->next = savednext;
-		}
-		te = savednext;
-	}
-	return prev;
+	interp_job *job = arg;
+	interp *ip = interp_new();
+	int i;
 
+	ip->use_tree_walker = job->tree_walker;
+	eval_string(ip, "(define fib (lambda (n) (if (< n 2) n"
+		    " (+ (fib (- n 1)) (fib (- n 2))))))"
+		    "(define build (lambda (n l) (if (< n 1) l"
+		    " (build (- n 1) (cons n l)))))"
+		    "(define total (lambda (l n) (if (null? l) n"
+		    " (total (cdr l) (+ n (car l))))))");
+	for (i = 0; i < job->rounds; i++) {
+		if (get_int(eval_string(ip, "(fib 20)")) != 6765
+		    || get_int(eval_string(ip, "(total (build 10000 '()) 0)"))
+		    != 50005000)
+			job->failed = true;
+	}
+	interp_free(ip);
+	vm_thread_free();
+	return NULL;
 }
 
-expr *eval(expr * e, env * en)
+/*
+ * Run n interpreters at the same time, each on a thread of its own.
+ * Params:
+ *   rounds : the number of times each interpreter runs its program.
+ * Returns:
+ *   the number of interpreters which computed a wrong result.
+ */
+int run_interps(int n, int rounds, bool tree_walker)
 {
-	debug_info("%s", "eval called with");
-	print_expr_debug(e);
-
-	/* Store the current environment for the garbage collection. */
-	current_env = en;
+	interp_job *jobs = calloc(n, sizeof(interp_job));
+	int i, failed = 0;
 
-	if (e->type == EXPRSYM) {
-		expr *res = find_in_dict(e, en);
-		if (res == NULL) {
-			print_err("Variable not defined here: %s.\n",
-				  e->symvalue);
-			exit(-1);
-		}
-		expr *copy = create_expr(EXPRSYM);
-		memcpy(copy, res, sizeof(expr));
-		return copy;
-	}
-	if (e->type != EXPRLIST) {
-		return e;
-	}
-	if (e->listptr == NULL) {
-		print_err("%s", "Empty list (probably...)\n");
-		exit(-1);
-	}
-	/* DEFINE */
-	if (e->listptr->type == EXPRSYM
-	    && (strcmp(e->listptr->symvalue, "define") == 0
-		|| strcmp(e->listptr->symvalue, "set!") == 0)) {
-		int size = get_list_size(e);
-		if (size != 3) {
-			print_err
-			    ("Wrong number of arguments for 'define'/'set!': %d\n",
-			     size);
-			exit(-1);
-		}
-		expr *key = get_next(e, 1);
-		expr *value = get_next(e, 2);
-		if (key->type != EXPRSYM) {
-			print_err
-			    ("%s",
-			     "Argument 1 for 'define'/'set!' is not a symbol.\n");
-			exit(-1);
-		}
-		value = eval(value, en);
-		if (add_to_env
-		    (en, key, value,
-		     strcmp(e->listptr->symvalue, "set!") == 0) == NULL) {
-			print_err("Could not define/set %s.\n", key->symvalue);
-			exit(-1);
-		}
-		debug_info("Defined value %s.\n", key->symvalue);
-		return create_exprempty();
-	}
-	/* QUOTE */
-	if (e->listptr->type == EXPRSYM
-	    && strcmp(e->listptr->symvalue, "quote") == 0) {
-		expr *next = e->listptr->next;
-		e->listptr = next;
-		return e;
-	}
-	/* IF */
-	if (e->listptr->type == EXPRSYM
-	    && strcmp(e->listptr->symvalue, "if") == 0) {
-		if (get_list_size(e) != 4) {
-			print_err
-			    ("%s", "Wrong number of arguments for 'if'.\n");
-			exit(-1);
-		}
-		expr *cond = eval(get_next(e, 1), en);
-		expr *trueex = get_next(e, 2);
-		expr *falseex = get_next(e, 3);
-		if (cond->type == EXPRINT)
-			return eval(trueex, en);
-		else if (cond->type != EXPRSYM) {
-			print_err
-			    ("%s",
-			     "Illegal if condition. Must be Symbol or number\n");
-			exit(-1);
-		} else if (strcmp(cond->symvalue, TRUE) == 0)
-			return eval(trueex, en);
-		else if (strcmp(cond->symvalue, FALSE) == 0)
-			return eval(falseex, en);
-		else {
-			print_err("%s", "Wrong Symbol");
+	for (i = 0; i < n; i++) {
+		jobs[i].rounds = rounds;
+		jobs[i].tree_walker = tree_walker;
+		if (pthread_create(&jobs[i].thread, NULL, interp_job_main,
+				   &jobs[i]) != 0) {
+			print_err("%s", "Could not start a thread.\n");
 			exit(-1);
 		}
-
 	}
-	if (e->listptr->type == EXPRSYM
-	    && strcmp(e->listptr->symvalue, "begin") == 0) {
-		e->listptr = e->listptr->next;
-		return evalList(e, en);
+	for (i = 0; i < n; i++) {
+		pthread_join(jobs[i].thread, NULL);
+		if (jobs[i].failed)
+			failed++;
 	}
-	/* LAMBDA */
-	if (e->listptr->type == EXPRSYM
-	    && strcmp(e->listptr->symvalue, "lambda") == 0) {
-		expr *args = get_next(e, 1);
-		if (args->type != EXPRLIST) {
-			print_err
-			    ("%s", "First Lambda Parameter must be a list\n");
-			exit(-1);
-		}
-		/* List with only the body */
-		e->listptr = args->next;
-		expr *lambda = create_expr(EXPRLAMBDA);
-		lambda->lambdavars = args;
-		lambda->lambdaexpr = e;
-		return lambda;
+	free(jobs);
+	return failed;
+}
 
-	}
-	evalList(e, en);
-	if (e->listptr->type == EXPRLAMBDA) {
-		env *newenv =
-		    create_env(e->listptr->lambdaenv ==
-			       NULL ? en : e->listptr->lambdaenv, NULL);
+/*
+ * Measure how the throughput scales with the number of interpreters
+ * which run at the same time. Prints one line for 1, 2, 4, ... up to
+ * max interpreters; each of them runs the same program.
+ */
+void bench_interps(int max, bool tree_walker)
+{
+	const int rounds = 20;
+	double base = 0;
+	int n;
 
-		int argnum = get_list_size(e->listptr->lambdavars);
-		if (argnum != get_list_size(e) - 1) {
-			print_err
-			    ("Wrong number of arguments for lambda %d required: %d\n",
-			     argnum, get_list_size(e) - 1);
+	out_printf("%12s %12s %12s %12s\n", "interpreters", "seconds",
+		   "rounds/s", "speedup");
+	for (n = 1; n <= max; n = n < max && n * 2 > max ? max : n * 2) {
+		double start = clock_seconds();
+		if (run_interps(n, rounds, tree_walker) != 0) {
+			print_err("%s",
+				  "An interpreter computed a wrong result.\n");
 			exit(-1);
 		}
-		expr *args = e->listptr->lambdavars->listptr;
-		expr *val = e->listptr->next;
-		while (args != NULL) {
-			if (args->type != EXPRSYM) {
-				print_err
-				    ("%s", "Wrong parameter list for lambda\n");
-				exit(-1);
-			}
-			add_to_env(newenv, args, val, false);
-			args = args->next;
-			val = val->next;
-		}
-		debug_info("%s", "Evaluate Lambda Expr\n");
-		expr *res = 0;
-		print_expr_debug(e->listptr->lambdaexpr);
-		expr *lambda_new = deep_copy(e->listptr->lambdaexpr);
-		lambda_new->lambdaenv = newenv;
-		if (lambda_new->type == EXPRLIST) {
-			debug_info("%s", " as list\n");
-			res = evalList(lambda_new, newenv);
-		} else {
-			debug_info("%s", "as single expr\n");
-			expr *res = eval(lambda_new, newenv);
-		}
-		if (res->type == EXPRLAMBDA) {
-			res->lambdaenv = newenv;
-		}
-		return res;
-	}
-	if (e->listptr->type == EXPRPROC) {
-		expr *proc = e->listptr;
-		/** delete proc from list **/
-		debug_info("%s", "Call proc!\n");
-		print_expr_debug(e);
-		expr *res = proc->proc(e->listptr->next);
-		/* TODO: some functions return low values like printf etc. The should be ignored and are handled as NULL now */
-		if ((int)res > -32 && (int)res < 32) {
-			res = create_exprempty();
-		}
-		print_expr_debug(res);
-		return res;
+		double seconds = clock_seconds() - start;
+		double throughput = n * rounds / seconds;
+		if (n == 1)
+			base = throughput;
+		out_printf("%12d %12.3f %12.1f %12.2f\n", n, seconds,
+			   throughput, throughput / base);
+		if (n == max)
+			break;
 	}
-
-	/* We should never arrive here... */
-	print_err("%s", "Could not evaluate expression: ");
-	print_expr(e);
-	exit(-1);
 }
 
-expr *read(char *s[])
+/* A native procedure for test_embedding: it adds n to a total. */
+static value test_accumulate(interp * ip, void *data, int argc,
+			     value * argv)
 {
-	debug_info("Read called with %s\n", *s);
-	char *tptr;
-	for (tptr = *s; *tptr != 0 && *tptr == ' '; tptr++) ;
-	if (*tptr == 0) {
-		print_err("%s", "EOF not expected\n");
-		exit(-1);
-	}
-	int tokenlen;
-	char *tmpptr;
-	if (*tptr == '(') {
-		expr *exprlist = create_expr(EXPRLIST);
-		exprlist->listptr = 0;
-		tptr++;
-		while (*tptr != ')') {
-			add_to_exprlist(exprlist, read(&tptr));
-			for (; *tptr != 0 && *tptr == ' '; tptr++) ;
-		}
-		tptr++;
-		*s = tptr;
-		return exprlist;
-	} else if (*tptr == ')') {
-		print_err("%s", "')' was not expected here\n");
-		exit(-1);
-		tokenlen = 1;
-	} else {
-		/* Create empty expression. */
-		if (strncmp(tptr, "'()", 3) == 0) {
-			*s = tptr + 3;
-			return create_exprempty();
-		}
-
-		/* Calculate the token length. */
-		for (tokenlen = 0, tmpptr = tptr;
-		     *tmpptr != 0 && *tmpptr != ' ' && *tmpptr != '('
-		     && *tmpptr != ')'; tokenlen++, tmpptr++) ;
-
-		expr *new;
-
-		char *endptr = NULL;
-		long long int intval = strtoll(tptr, &endptr, 0);
-		if (endptr == tptr) {
-			if (tokenlen > MAXTOKENLEN) {
-				print_err
-				    ("Token to long! Maximum token size: %d\n",
-				     MAXTOKENLEN);
-				exit(-1);
-			}
-			/* Create a symbol if the int parsing fails: */
-			char token[tokenlen + 1];
-			token[tokenlen] = 0;
-			strncpy(token, tptr, tokenlen);
-			new = create_exprsym(token);
-		} else {
-			new = create_exprint(intval);
-		}
-
-		*s = tmpptr;
-
-		return new;
-	}
+	long long int *total = data;
+	*total += get_int(argv[0]);
+	return make_int(ip, *total);
 }
 
-/**        LAMBDA PREDEFINED FUNCTIONS: **/
-
 /*
- * Apply a general integer arithmetic function on an expression list.
- * Params:
- *   args : a pointer to an expr struct.
- *          This must be an integer expr or a list of integer exprs.
- *   func : a function pointer to an arithmetic function, e.g. add().
- *   neutral : the neutral element for the arithmeitc operation.
- *             E.g. 0 for add and 1 for mulitplication.
- *   as_bool : true if the resulting expression should be a boolean
- *             symbol expression instead of an integer expression.
- *             If the return value of func is 0, then the bool value
- *             is set to FALSE. Othewise it's TRUE.
+ * Test the embedding interface on an interpreter of its own: a closure
+ * which calls a native procedure is called from C, while the
+ * collections move it.
  * Returns:
- *   a pointer to an expression struct which equals the evaluation of
- *   the given integer expressions according to func.
- *   Returns NULL if the given expression pointer (args) is not an
- *   EXPRINT or an EXPRLIST of EXPRINTs.
- */
-expr *math(expr * args, int (*func) (long long int, long long int, bool *),
-	   int neutral, bool as_bool)
-{
-	long long int result = neutral;
-	bool b = true;
-	expr *arg = args;
-	while (arg != NULL) {
-		if (arg->type != EXPRINT) {
-			print_err("%s", "Error Math without int\n");
-			exit(1);
-		}
-		result = func(result, arg->intvalue, &b);
-		arg = arg->next;
-	}
-
-	expr *newexpr;
+ *   true if all results are right.
+ */
+static bool test_embedding(bool tree_walker)
+{
+	miniclisp *ip = miniclisp_new();
+	const char *src = "(define twice (lambda (n) (* 2 (accumulate n))))"
+	    "(define build (lambda (n l) (if (< n 1) l"
+	    " (build (- n 1) (cons n l)))))";
+	long long int total = 0;
+	miniclisp_value form, twice, build, res;
+	miniclisp_value args[2];
+	bool ok = true;
+	int i;
 
-	if (as_bool) {
-		if (!b)
-			newexpr = create_exprsym(FALSE);
-		else
-			newexpr = create_exprsym(TRUE);
-	} else {
-		newexpr = create_exprint(result);
+	ip->use_tree_walker = tree_walker;
+	miniclisp_define_native(ip, "accumulate", test_accumulate, 1, &total);
+	while ((form = miniclisp_read(ip, &src)) != NULL)
+		miniclisp_eval(ip, form);
+	size_t roots = miniclisp_roots_save(ip);
+	twice = miniclisp_lookup(ip, "twice");
+	build = miniclisp_lookup(ip, "build");
+	miniclisp_root(ip, &twice);
+	miniclisp_root(ip, &build);
+	for (i = 1; i <= 100; i++) {
+		args[0] = miniclisp_int(ip, i);
+		res = miniclisp_call(ip, twice, 1, args);
+		if (!miniclisp_is_int(res)
+		    || miniclisp_get_int(res) != 2 * total)
+			ok = false;
+		/* Garbage, so that collections run in between. */
+		args[0] = miniclisp_int(ip, 2000);
+		args[1] = MINICLISP_EMPTY;
+		res = miniclisp_call(ip, build, 2, args);
+		if (!miniclisp_is_pair(res)
+		    || miniclisp_get_int(miniclisp_car(res)) != 1)
+			ok = false;
 	}
+	miniclisp_roots_restore(ip, roots);
+	if (total != 5050)
+		ok = false;
 
-	return newexpr;
-	return NULL;		//What to do??
+	/* The lambdas of evaluated forms do not pile up. */
+	size_t nlambdas = ip->nlambdas;
+	for (i = 0; i <= 1000; i++) {
+		const char *s = "((lambda (x) x) 1)";
+		if (i == 1000)
+			ip->gc_major_pending = true;
+		miniclisp_eval(ip, miniclisp_read(ip, &s));
+	}
+	if (ip->nlambdas > nlambdas + 1)
+		ok = false;
+	miniclisp_free(ip);
+	return ok;
 }
 
-/* a + b */
-int addInt(long long int a, long long int b, bool * c)
+/*
+ * Test images: the definitions of one interpreter are saved and loaded
+ * into two others, which get their own data for the native procedure.
+ * Returns:
+ *   true if all results are right.
+ */
+static bool test_image(bool tree_walker)
 {
-	return a + b;
-}
+	char path[] = "/tmp/miniclisp-XXXXXX";
+	char save[64];
+	long long int total = 0;
+	interp *ip;
+	bool ok = true;
+	int fd = mkstemp(path);
 
-/* a - b */
-int subInt(long long int a, long long int b, bool * c)
-{
-	return a - b;
-}
+	if (fd < 0 || fclose(fdopen(fd, "w")) != 0)
+		return false;
+	snprintf(save, sizeof(save), "(save-image (quote %s))", path);
 
-/* a * b */
-int mulInt(long long int a, long long int b, bool * c)
-{
-	return a * b;
-}
+	ip = interp_new();
+	ip->use_tree_walker = tree_walker;
+	miniclisp_define_native(ip, "accumulate", test_accumulate, 1, &total);
+	eval_string(ip, "(define adder (lambda (n) (lambda (x) (+ x n))))"
+		    "(define add5 (adder 5))"
+		    "(define counter 0)"
+		    "(define bump (lambda () (set! counter (+ counter 1))"
+		    " (accumulate counter)))"
+		    "(define even (lambda (n) (if (< n 1) #t (odd (- n 1)))))"
+		    "(define odd (lambda (n) (if (< n 1) #f (even (- n 1)))))"
+		    "(define big (* 4611686018427387904 4611686018427387904))"
+		    "(define v (make-vector 3 7))"
+		    "(define build (lambda (n l) (if (< n 1) l"
+		    " (build (- n 1) (cons n l)))))"
+		    "(define total (lambda (l n) (if (null? l) n"
+		    " (total (cdr l) (+ n (car l))))))" "(bump)");
+	eval_string(ip, save);
+	interp_free(ip);
 
-/* a < b */
-int lessInt(long long int a, long long int b, bool * c)
-{
-	if (!(a < b))
-		*c = false;
-	return b;
-}
+	ip = interp_new();
+	ip->use_tree_walker = tree_walker;
+	total = 100;
+	miniclisp_define_native(ip, "accumulate", test_accumulate, 1, &total);
+	if (!load_image(ip, path)) {
+		ok = false;
+	} else if (get_int(eval_string(ip, "(add5 10)")) != 15
+		   || get_int(eval_string(ip, "(bump)")) != 102
+		   || total != 102
+		   || eval_string(ip, "(even 1001)") != VAL_FALSE
+		   || get_int(eval_string(ip, "(vector-sum v)")) != 21
+		   || get_int(eval_string(ip, "(total (build 100000 '()) 0)"))
+		   != 5000050000
+		   || get_int(eval_string(ip, "(- big (* big 1))")) != 0) {
+		ok = false;
+	}
 
-/* a > b */
-int greaterInt(long long int a, long long int b, bool * c)
-{
-	if (a <= b)
-		*c = false;
-	return b;
+	/*
+	 * The first interpreter has the image at its address, so this one
+	 * relocates it. Its pages are copied on write: the counter starts
+	 * from the saved value again.
+	 */
+	interp *other = interp_new();
+	long long int other_total = 200;
+	char define[64];
+	int i;
+	other->use_tree_walker = tree_walker;
+	miniclisp_define_native(other, "accumulate", test_accumulate, 1,
+				&other_total);
+	if (!load_image(other, path)) {
+		ok = false;
+	} else {
+		/* Grow the global frame of the image. */
+		for (i = 0; i < 1000; i++) {
+			snprintf(define, sizeof(define), "(define g%d %d)", i,
+				 i);
+			eval_string(other, define);
+		}
+		other->gc_major_pending = true;
+		if (get_int(eval_string(other, "(bump)")) != 202
+		    || get_int(eval_string(other, "(+ g999 (add5 1))")) != 1005
+		    || get_int(eval_string(ip, "(bump)")) != 105)
+			ok = false;
+	}
+	interp_free(other);
+	interp_free(ip);
+	remove(path);
+	return ok;
 }
 
-expr *add(expr * args)
+/*
+ * Run some tests...
+ * A nice collection of basic scheme test can be found on:
+ *   http://norvig.com/lispytest.py
+ * TODO: Remove all of those exit(-1) so we can test several wrong inputs.
+ * Returns:
+ *   the number of failed tests.
+ */
+int run_tests(interp * ip)
 {
-	math(args, addInt, 0, false);
-}
+	out_str("Running tests...\n");
 
-expr *sub(expr * args)
-{
-	math(args, subInt, 0, false);
-}
+	if (!test_tags(ip)) {
+		print_err("%s", "Misaligned heap objects.\n");
+		tests_failed++;
+	}
 
-expr *mul(expr * args)
-{
-	math(args, mulInt, 1, false);
+	test_int(ip, "(+ 2 2)", 4, ip->global_env);
+	test_int(ip, "(+ (* 2 100) (* 1 10))", 210, ip->global_env);
+	test_int(ip, "(if (> 6 5) (+ 1 1) (+ 2 2))", 2, ip->global_env);
+	test_int(ip, "(if (< 6 5) (+ 1 1) (+ 2 2))", 4, ip->global_env);
+	test(ip, "(define x 3)", ip->global_env);
+	test_int(ip, "x", 3, ip->global_env);
+	test_int(ip, "(+ x x)", 6, ip->global_env);
+	test_int(ip, "((lambda (x) (+ x x)) 5)", 10, ip->global_env);
+	test(ip, "(define twice (lambda (x) (* 2 x)))", ip->global_env);
+	test_int(ip, "(twice 5)", 10, ip->global_env);
+	test(ip, "(define fact (lambda (n) (if (< (+ n -1) 1) 1 (* n (fact (+ n -1))))))", ip->global_env);
+	test_int(ip, "(fact 10)", 3628800, ip->global_env);
+	test(ip, "(define a 0)", ip->global_env);
+	test(ip, "(define f_def (lambda (n) (begin (define a n) a)))",
+	     ip->global_env);
+	test_int(ip, "(f_def 10)", 10, ip->global_env);
+	test_int(ip, "a", 0, ip->global_env);
+	test(ip, "(define f_set (lambda (n) (begin (set! a n) a)))",
+	     ip->global_env);
+	test_int(ip, "(f_set 12)", 12, ip->global_env);
+	test_int(ip, "a", 12, ip->global_env);
+	test(ip, "(define adder (lambda (n) (lambda (x) (+ x n))))",
+	     ip->global_env);
+	test_int(ip, "((adder 1) 2)", 3, ip->global_env);
+	test(ip, "(define add5 (adder 5))", ip->global_env);
+	test(ip, "(define apply1 (lambda (g n) (g 1)))", ip->global_env);
+	test_int(ip, "(apply1 add5 100)", 6, ip->global_env);
+	test(ip, "(define a_symbol_which_is_longer_than_32_characters 7)",
+	     ip->global_env);
+	test_int(ip, "(+ a_symbol_which_is_longer_than_32_characters 1)", 8,
+		 ip->global_env);
+	test_int(ip, "(+ 1 ; a comment\n\t2)\n", 3, ip->global_env);
+	test_int(ip, "(+ 0x10 010 -1)", 23, ip->global_env);
+	test_int(ip, "(if #t (begin 1 2) 3)", 2, ip->global_env);
+	test_int(ip, "(if (if (> 1 2) #t #f) 1 2)", 2, ip->global_env);
+	test(ip, "(define five (lambda () (quote 5)))", ip->global_env);
+	test_int(ip, "(five)", 5, ip->global_env);
+	test_int(ip, "(five)", 5, ip->global_env);
+	test(ip, "(define count (lambda (n) (if (< n 1) 0 (count (+ n -1)))))",
+	     ip->global_env);
+	test_int(ip, "(count 100000)", 0, ip->global_env);
+	test(ip, "(define even (lambda (n) (if (< n 1) #t (odd (+ n -1)))))",
+	     ip->global_env);
+	test(ip, "(define odd (lambda (n) (if (< n 1) #f (even (+ n -1)))))",
+	     ip->global_env);
+	test_int(ip, "(if (even 100001) 1 2)", 2, ip->global_env);
+	test_int(ip, "(if (> (stats (quote lambda-applications)) 100000) 1 2)", 1,
+		 ip->global_env);
+	test(ip, "(define y 1)", ip->global_env);
+	test(ip, "(define early (lambda () (begin (define r y) (define y 2) (+ r y))))",
+	     ip->global_env);
+	test_int(ip, "(early)", 3, ip->global_env);
+	test(ip, "(set! y 10)", ip->global_env);
+	test_int(ip, "(early)", 12, ip->global_env);
+	test(ip, "(define inner (lambda (flag) (begin (if flag (define y 5) 0)"
+	     " ((lambda () (begin (define z y) (define y 7) z))))))",
+	     ip->global_env);
+	test_int(ip, "(inner #f)", 10, ip->global_env);
+	test_int(ip, "(inner #t)", 5, ip->global_env);
+	test_int(ip, "(inner #f)", 10, ip->global_env);
+	test_int(ip, "(- 10 1 2)", 7, ip->global_env);
+	test_int(ip, "(- 5)", -5, ip->global_env);
+	test_int(ip, "(fact 20)", 2432902008176640000LL, ip->global_env);
+	test_int(ip, "(- (fact 25) (* 25 (fact 24)))", 0, ip->global_env);
+	test_int(ip, "(+ 4611686018427387903 1)", 4611686018427387904LL,
+		 ip->global_env);
+	test_int(ip, "(+ (* 9223372036854775807 2) -9223372036854775807)",
+		 9223372036854775807LL, ip->global_env);
+	test_int(ip, "(- 100000000000000000000 99999999999999999999)", 1,
+		 ip->global_env);
+	test_int(ip, "(if (< (- 0 (fact 30)) -5 (fact 30) (fact 31)) 1 2)", 1,
+		 ip->global_env);
+	test(ip, "(define square_sum (lambda (a b) (- (* (+ a b) (+ a b))"
+	     " (* a a) (* 2 a b) (* b b))))", ip->global_env);
+	test_int(ip, "(square_sum (fact 500) (fact 250))", 0, ip->global_env);
+	test_int(ip, "(square_sum (fact 400) (- 0 (fact 390)))", 0,
+		 ip->global_env);
+	test(ip, "(define v (make-vector 101))", ip->global_env);
+	test(ip, "(define fill (lambda (v i) (if (< i (vector-length v))"
+	     " (begin (vector-set! v i (- i 50)) (fill v (+ i 1))) v)))",
+	     ip->global_env);
+	test(ip, "(fill v 0)", ip->global_env);
+	test_int(ip, "(vector-sum v)", 0, ip->global_env);
+	test_int(ip, "(vector-dot v v)", 85850, ip->global_env);
+	test_int(ip, "(vector-max v)", 50, ip->global_env);
+	test_int(ip, "(vector-ref (vector-add v v) 7)", -86, ip->global_env);
+	test_int(ip, "(vector-ref (vector-mul v v) 100)", 2500, ip->global_env);
+	test(ip, "(define w (make-vector 9 4611686018427387904))",
+	     ip->global_env);
+	test_int(ip, "(- (vector-sum w) (* 9 4611686018427387904))", 0,
+	         ip->global_env);
+	test_int(ip, "(- (vector-dot w w) (* 9 4611686018427387904"
+		 " 4611686018427387904))", 0, ip->global_env);
+	test_int(ip, "(vector-max (vector-mul w (make-vector 9 -1)))",
+		 -4611686018427387904LL, ip->global_env);
+	test_int(ip, "(car (cdr (list 1 2 3)))", 2, ip->global_env);
+	test_int(ip, "(car (car (cdr (quote (a (7 8))))))", 7, ip->global_env);
+	test_int(ip, "(cdr (cons 1 2))", 2, ip->global_env);
+	test_int(ip, "(if (null? (cdr (list 1))) 1 2)", 1, ip->global_env);
+	test_int(ip, "(if (null? (list 1)) 1 2)", 2, ip->global_env);
+	test(ip, "(define build (lambda (n l) (if (< n 1) l"
+	     " (build (+ n -1) (cons n l)))))", ip->global_env);
+	test(ip, "(define total (lambda (l n) (if (null? l) n"
+	     " (total (cdr l) (+ n (car l))))))", ip->global_env);
+	/* Two lists which share a tail; the tail must survive collections. */
+	test(ip, "(define tail (build 20000 '()))", ip->global_env);
+	test(ip, "(define l1 (cons 1 tail))", ip->global_env);
+	test(ip, "(define l2 (cons 2 tail))", ip->global_env);
+	test_int(ip, "(- (total l2 0) (total l1 0))", 1, ip->global_env);
+	test_int(ip, "(total l1 0)", 200010001, ip->global_env);
+	test(ip, "(define make-counter (lambda () (define n 0)"
+	     " (lambda () (set! n (+ n 1)) n)))", ip->global_env);
+	test(ip, "(define c1 (make-counter))", ip->global_env);
+	test(ip, "(c1)", ip->global_env);
+	test_int(ip, "(c1)", 2, ip->global_env);
+	test_int(ip, "((make-counter))", 1, ip->global_env);
+	test_int(ip, "((((lambda (a) (lambda (b) (lambda (c) (+ a b c)))) 1) 2) 3)",
+		 6, ip->global_env);
+	test(ip, "(define parity (lambda (n)"
+	     " (define ev (lambda (k) (if (< k 1) #t (od (- k 1)))))"
+	     " (define od (lambda (k) (if (< k 1) #f (ev (- k 1)))))"
+	     " (if (ev n) 1 0)))", ip->global_env);
+	test_int(ip, "(parity 10)", 1, ip->global_env);
+	/* Two closures share the box of a mutated variable. */
+	test(ip, "(define box (lambda (x) (list (lambda () x)"
+	     " (lambda (v) (set! x v)))))", ip->global_env);
+	test(ip, "(define b (box 1))", ip->global_env);
+	test(ip, "((car (cdr b)) 5)", ip->global_env);
+	test_int(ip, "((car b))", 5, ip->global_env);
+	test_int(ip, "(touch (future (+ 1 2)))", 3, ip->global_env);
+	test_int(ip, "(touch 5)", 5, ip->global_env);
+	test(ip, "(define pfib (lambda (n) (if (< n 2) n"
+	     " (pcall + (pfib (- n 1)) (pfib (- n 2))))))", ip->global_env);
+	test_int(ip, "(pfib 20)", 6765, ip->global_env);
+	test(ip, "(define psum (lambda (l) (if (null? l) 0"
+	     " (let-sum (future (car l)) (future (psum (cdr l)))))))",
+	     ip->global_env);
+	test(ip, "(define let-sum (lambda (a b) (+ (touch a) (touch b))))",
+	     ip->global_env);
+	/* Each task allocates, so collections happen while tasks run. */
+	test_int(ip, "(psum (build 2000 '()))", 2001000, ip->global_env);
+	if (run_interps(4, 2, ip->use_tree_walker) != 0) {
+		print_err("%s", "Concurrent interpreters failed.\n");
+		tests_failed++;
+	}
+	if (!test_embedding(ip->use_tree_walker)) {
+		print_err("%s", "The embedding interface failed.\n");
+		tests_failed++;
+	}
+	if (!test_image(ip->use_tree_walker)) {
+		print_err("%s", "Images failed.\n");
+		tests_failed++;
+	}
+	return tests_failed;
 }
 
-expr *less(expr * args)
+/*
+ * Measure the cost of a variable lookup in an environment frame as the
+ * number of definitions in that frame grows. Prints one line per frame
+ * size with the average time per `find_in_dict' call.
+ */
+void bench_env(interp * ip)
 {
-	math(args, lessInt, INT_MIN, true);
-}
+	const size_t sizes[] = { 4, 16, 256, 4096, 65536 };
+	const long lookups = 4000000;
+	char name[32];
+	size_t i, j;
+	value one = make_int(ip, 1);
 
-expr *greater(expr * args)
-{
-	math(args, greaterInt, INT_MAX, true);
+	out_printf("%12s %12s\n", "definitions", "ns/lookup");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		env *en = create_env(ip, NULL, 0);
+		symbol **syms = malloc(sizes[i] * sizeof(symbol *));
+		for (j = 0; j < sizes[i]; j++) {
+			snprintf(name, sizeof(name), "bench-%zu", j);
+			syms[j] = intern(ip, name);
+			add_to_env(ip, en, syms[j], one, false);
+		}
+
+		struct timespec start, end;
+		long long int sum = 0;
+		long n;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (n = 0, j = 0; n < lookups; n++) {
+			sum += get_int(find_in_dict(ip, syms[j], en));
+			if (++j == sizes[i])
+				j = 0;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		double ns = (end.tv_sec - start.tv_sec) * 1e9
+		    + (end.tv_nsec - start.tv_nsec);
+		out_printf("%12zu %12.2f\n", sizes[i], ns / lookups);
+		debug_info("Checksum %lld\n", sum);
+		free(syms);
+	}
 }
 
 /*
- * Inititalizes an environment with global values.
+ * Evaluate all expressions of a file without interaction.
  * Params:
- *   en : the environment which should be initialized.
+ *   path : the file name; "-" is the standard input.
+ *   print : print the value of every expression.
+ * Returns:
+ *   the exit status.
  */
-void init_global(env * en)
+int run_script(interp * ip, const char *path, bool print)
 {
-	add_to_env(en, create_exprsym("gc"), create_exprproc(gc), false);
-	add_to_env(en, create_exprsym(TRUE), create_exprsym(TRUE), false);
-	add_to_env(en, create_exprsym(FALSE), create_exprsym(FALSE), false);
-	add_to_env(en, create_exprsym("+"), create_exprproc(add), false);
-	add_to_env(en, create_exprsym("-"), create_exprproc(sub), false);
-	add_to_env(en, create_exprsym("*"), create_exprproc(mul), false);
-	add_to_env(en, create_exprsym("<"), create_exprproc(less), false);
-	add_to_env(en, create_exprsym(">"), create_exprproc(greater), false);
-}
+	reader *in = reader_open(path);
+	if (in == NULL) {
+		print_err("Could not open %s.\n", path);
+		return 1;
+	}
 
-expr *test(char *str, env * en)
-{
-	return eval(read(&str), en);
+	value e;
+	while ((e = read_expr(ip, in)) != NULL) {
+		value v = eval_toplevel(ip, e, ip->global_env);
+		if (print) {
+			_print_value(v, false);
+			out_char('\n');
+		}
+	}
+	reader_close(in);
+	return 0;
 }
 
-bool test_int(char *str, int intvalue, env * en)
-{
+/* The interpreter of the command line; --stats prints its counters. */
+static interp *stats_interp;
 
-	char *tmp = str;
-	expr *retval = test(str, en);
-	if (retval->type == EXPRINT && retval->intvalue == intvalue) {
-		debug_info("Success. %s == %d\n\n", tmp, intvalue);
-		return true;
-	}
-	print_err("Test failed for %s : %d. Result: ", tmp, intvalue);
-	print_expr(retval);
-	return false;
+static void stats_at_exit()
+{
+	stats_dump(stats_interp);
 }
 
-/*
- * Run some tests...
- * A nice collection of basic scheme test can be found on:
- *   http://norvig.com/lispytest.py
- * TODO: Remove all of those exit(-1) so we can test several wrong inputs.
- */
-int run_tests()
-{
-	printf("Running tests...\n");
-
-	test_int("(+ 2 2)", 4, global_env);
-	test_int("(+ (* 2 100) (* 1 10))", 210, global_env);
-	test_int("(if (> 6 5) (+ 1 1) (+ 2 2))", 2, global_env);
-	test_int("(if (< 6 5) (+ 1 1) (+ 2 2))", 4, global_env);
-	test("(define x 3)", global_env);
-	test_int("x", 3, global_env);
-	test_int("(+ x x)", 6, global_env);
-	test_int("((lambda (x) (+ x x)) 5)", 10, global_env);
-	test("(define twice (lambda (x) (* 2 x)))", global_env);
-	test_int("(twice 5)", 10, global_env);
-	test("(define fact (lambda (n) (if (< (+ n -1) 1) 1 (* n (fact (+ n -1))))))", global_env);
-	test_int("(fact 10)", 3628800, global_env);
-	test("(define a 0)", global_env);
-	test("(define f_def (lambda (n) (begin (define a n) a)))", global_env);
-	test_int("(f_def 10)", 10, global_env);
-	test_int("a", 0, global_env);
-	test("(define f_set (lambda (n) (begin (set! a n) a)))", global_env);
-	test_int("(f_set 12)", 12, global_env);
-	test_int("a", 12, global_env);
-}
-
-#define MAXINPUT 512
-
+#ifndef MINICLISP_LIBRARY
 int main(int argc, char **argv)
 {
-	char inputbuf[MAXINPUT];
-	global_env = create_env(NULL, NULL);
-	init_global(global_env);
+	interp *ip = interp_new();
+	simd_init(NULL);
+	atexit(out_flush);
+	ip->worker_count = get_nprocs() < MAX_WORKERS ? get_nprocs()
+	    : MAX_WORKERS;
+	bool tests = false, print = false;
+	const char *script = NULL, *image = NULL;
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--tree-walker") == 0) {
+			ip->use_tree_walker = true;
+		} else if (strcmp(argv[i], "--tests") == 0) {
+			tests = true;
+		} else if (strcmp(argv[i], "--print") == 0) {
+			print = true;
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			stats_interp = ip;
+			atexit(stats_at_exit);
+		} else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+			if (!simd_init(argv[++i])) {
+				print_err("SIMD kernels %s are not available.\n",
+					  argv[i]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+			image = argv[++i];
+		} else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+			prof_start(argv[++i]);
+		} else if (strcmp(argv[i], "--bench") == 0) {
+			run_bench(ip);
+			return 0;
+		} else if (strcmp(argv[i], "--bench-env") == 0) {
+			bench_env(ip);
+			return 0;
+		} else if (strcmp(argv[i], "--bench-read") == 0
+			   && i + 1 < argc) {
+			return bench_read(ip, argv[++i]);
+		} else if (strcmp(argv[i], "--bench-interps") == 0
+			   && i + 1 < argc) {
+			bench_interps(atoi(argv[++i]), ip->use_tree_walker);
+			return 0;
+		} else if (strcmp(argv[i], "--gc-growth") == 0 && i + 1 < argc) {
+			ip->gc_growth = atof(argv[++i]);
+			if (ip->gc_growth < 1.0) {
+				print_err("%s", "GC growth factor must be >= 1.\n");
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--gc-min-heap") == 0
+			   && i + 1 < argc) {
+			ip->gc_min_heap = ip->gc_threshold =
+			    strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--gc-nursery") == 0
+			   && i + 1 < argc) {
+			ip->gc_nursery_size = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+			ip->worker_count = atoi(argv[++i]);
+			if (ip->worker_count < 1
+			    || ip->worker_count > MAX_WORKERS) {
+				print_err("Workers must be in 1..%d.\n",
+					  MAX_WORKERS);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--grain") == 0 && i + 1 < argc) {
+			ip->task_grain = atoi(argv[++i]);
+			if (ip->task_grain < 0 || ip->task_grain > DEQUE_SIZE) {
+				print_err("The grain must be in 0..%d.\n",
+					  DEQUE_SIZE);
+				return 1;
+			}
+		} else if (script == NULL
+			   && (argv[i][0] != '-' || strcmp(argv[i], "-") == 0)) {
+			script = argv[i];
+		} else {
+			fprintf(stderr, "Usage: %s [--gc-growth FACTOR] "
+				"[--gc-min-heap BYTES] [--gc-nursery BYTES] "
+				"[--tree-walker] [--tests] [--bench] [--bench-env] "
+				"[--bench-read FILE] [--bench-interps N] "
+				"[--print] [--stats] [--image FILE] "
+				"[--profile FILE] [--simd avx2|sse2|scalar] "
+				"[--workers N] [--grain N] [SCRIPT | -]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (image != NULL && !load_image(ip, image))
+		return 1;
+	if (tests)
+		return run_tests(ip) == 0 ? 0 : 1;
+	if (script != NULL)
+		return run_script(ip, script, print);
 #ifdef DEBUG
 	//run_tests();
 #endif
-	printf("Interactive Mini-Scheme interpreter:\n");
-	printf("  available forms are: define, set!, lambda, begin and if.\n");
-	printf("  available functions are: +, *, <, >\n");
+	out_str("Interactive Mini-Scheme interpreter:\n");
+	out_str("  available forms are: define, set!, lambda, begin and if.\n");
+	out_str("  available functions are: +, *, <, >\n");
+	reader *in = reader_open_file(stdin);
 	while (1) {
-		printf("> ");
-		fflush(stdout);
-		fgets(inputbuf, MAXINPUT, stdin);
-		char *newline = strrchr(inputbuf, '\n');
-		if (newline != NULL)
-			*newline = 0;
-		debug_info("CALL READ with'%s'\n", inputbuf);
-		char *ptr = inputbuf;
-		if (ptr[0] == 0)
-			print_warn("%s", "Empty line was ignored!\n");
-		else
-			print_expr(eval(read(&ptr), global_env));
+		out_str("> ");
+		out_flush();
+		value e = read_expr(ip, in);
+		if (e == NULL) {
+			out_char('\n');
+			return 0;
+		}
+		print_value(eval_toplevel(ip, e, ip->global_env));
 	}
 	system("/bin/sh");
 }
+#endif
@@ -0,0 +1,75 @@
+#ifndef MINICLISP_H
+#define MINICLISP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * The interface of libminiclisp, which embeds the interpreter in a C
+ * program. Build the library with `make lib' and link with
+ * -lminiclisp -pthread.
+ *
+ * A value is a fixnum, one of the constants below or a pointer into the
+ * heap of its interpreter. The collector moves heap objects, so a value
+ * which the program keeps while the interpreter runs must be registered
+ * with miniclisp_root. The values passed to a native procedure and the
+ * one it returns need no registration.
+ *
+ * Like the REPL, the interpreter prints an error and exits if the
+ * evaluation fails.
+ */
+typedef struct interp miniclisp;
+typedef struct valuetag *miniclisp_value;
+
+#define MINICLISP_FALSE ((miniclisp_value) 0x2)
+#define MINICLISP_TRUE ((miniclisp_value) 0x6)
+#define MINICLISP_EMPTY ((miniclisp_value) 0xa)
+
+/* Accepts any number of arguments; see miniclisp_define_native. */
+#define MINICLISP_VARIADIC -1
+
+/*
+ * A procedure of the embedding program. argv points into the value
+ * stack of the interpreter; it is not copied and is only valid until
+ * the procedure calls back into the interpreter.
+ */
+typedef miniclisp_value(*miniclisp_native) (miniclisp * ip, void *data,
+					    int argc, miniclisp_value * argv);
+
+#define MINICLISP_API __attribute__ ((visibility("default")))
+
+MINICLISP_API miniclisp *miniclisp_new(void);
+MINICLISP_API void miniclisp_free(miniclisp * ip);
+
+MINICLISP_API void miniclisp_define_native(miniclisp * ip, const char *name,
+					   miniclisp_native proc, int arity,
+					   void *data);
+MINICLISP_API void miniclisp_define(miniclisp * ip, const char *name,
+				    miniclisp_value v);
+MINICLISP_API miniclisp_value miniclisp_lookup(miniclisp * ip,
+					       const char *name);
+
+MINICLISP_API bool miniclisp_load_image(miniclisp * ip, const char *path);
+
+MINICLISP_API miniclisp_value miniclisp_read(miniclisp * ip, const char **s);
+MINICLISP_API miniclisp_value miniclisp_eval(miniclisp * ip,
+					     miniclisp_value form);
+MINICLISP_API miniclisp_value miniclisp_call(miniclisp * ip,
+					     miniclisp_value proc, int argc,
+					     miniclisp_value * argv);
+
+MINICLISP_API size_t miniclisp_roots_save(miniclisp * ip);
+MINICLISP_API void miniclisp_root(miniclisp * ip, miniclisp_value * ref);
+MINICLISP_API void miniclisp_roots_restore(miniclisp * ip, size_t roots);
+
+MINICLISP_API miniclisp_value miniclisp_int(miniclisp * ip, long long int i);
+MINICLISP_API bool miniclisp_is_int(miniclisp_value v);
+MINICLISP_API long long int miniclisp_get_int(miniclisp_value v);
+MINICLISP_API miniclisp_value miniclisp_cons(miniclisp * ip,
+					     miniclisp_value car,
+					     miniclisp_value cdr);
+MINICLISP_API bool miniclisp_is_pair(miniclisp_value v);
+MINICLISP_API miniclisp_value miniclisp_car(miniclisp_value v);
+MINICLISP_API miniclisp_value miniclisp_cdr(miniclisp_value v);
+
+#endif